@@ -20,12 +20,17 @@ static void caseflip_error(dl_socket_t *sock, ax25_dl_error_t err) {
 static void caseflip_data(dl_socket_t *sock, const uint8_t *data, size_t datalen) {
     DEBUG(STR("Got data, len="), D8(datalen));
     buffer_t *buf = buffer_allocate(data, datalen);
+    if (!buf) {
+        DEBUG(STR("caseflip: out of buffers, dropping data"));
+        return;
+    }
     for(size_t i = 0; i < buf->len; ++i) {
         if ((buf->buffer[i] >= 'A' && buf->buffer[i] <= 'Z') || (buf->buffer[i] >= 'a' && buf->buffer[i] <= 'z')) {
             buf->buffer[i] ^= ('a' - 'A');
         }
     }
-    dl_send(sock, buf->buffer, buf->len);
+    if (dl_send(sock, buf->buffer, buf->len) == DL_SEND_BUSY)
+        DEBUG(STR("caseflip: busy, dropping data"));
     buffer_free(&buf);
 }
 
@@ -7,6 +7,7 @@
 #include "ax25.h"
 #include "ax25_dl.h"
 #include "cmd.h"
+#include "config.h"
 #include "console.h"
 #include "kiss.h"
 #include "serial.h"
@@ -17,7 +18,7 @@ static void cmd_serial(terminal_t *term, token_t cmdline) {
         OUTPUT(term, STR("Unparsable serial port"));
         return;
     }
-    if (serial > 2 /* TODO: MAX_SERIAL */) {
+    if (serial >= MAX_SERIAL) {
         OUTPUT(term, STR("Invalid serial "), D8(serial));
         return;
     }
@@ -29,11 +30,47 @@ static void cmd_serial(terminal_t *term, token_t cmdline) {
     }
 
     if (token_cmp(protocol, token_from_str("kiss")) == 0) {
-        register_serial(serial, kiss_recv_byte, false);
+        token_t option;
+        while (token_get_word(&cmdline, &option)) {
+            if (token_cmp(option, token_from_str("ackmode")) == 0) {
+                /* ackmode [<unit>], all units on the line if none is given */
+                uint8_t unit;
+                token_t rest = cmdline;
+                if (token_get_u8(&rest, &unit)) {
+                    if (unit > 0xF) {
+                        OUTPUT(term, STR("Invalid kiss unit "), D8(unit));
+                        return;
+                    }
+                    cmdline = rest;
+                    kiss_set_ackmode(serial << 4 | unit, true);
+                } else {
+                    for (unit = 0; unit <= 0xF; ++unit)
+                        kiss_set_ackmode(serial << 4 | unit, true);
+                }
+            } else if (token_cmp(option, token_from_str("smack")) == 0) {
+                kiss_set_smack(serial, true);
+            } else if (token_cmp(option, token_from_str("flexnet")) == 0) {
+                kiss_set_flexnet_crc(serial, true);
+            } else if (token_cmp(option, token_from_str("tcp")) == 0) {
+                uint16_t tcpport;
+                if (!token_get_u16(&cmdline, &tcpport)) {
+                    OUTPUT(term, STR("Missing tcp port"));
+                    return;
+                }
+                if (!serial_listen_tcp(serial, tcpport)) {
+                    OUTPUT(term, STR("Unable to listen on tcp port "), INT(tcpport));
+                    return;
+                }
+            } else {
+                OUTPUT(term, STR("Unknown kiss option "), LENSTR(option.ptr, option.len));
+                return;
+            }
+        }
+        register_serial(serial, kiss_recv_buffer, false);
     } else if (token_cmp(protocol, token_from_str("console")) == 0) {
         terminal_t *term = terminal_find_or_allocate_from_serial(serial);
         term->rx = cmd_run;
-        register_serial(serial, console_recv_byte, true);
+        register_serial(serial, console_recv_bytes, true);
     } else {
         OUTPUT(term, STR("Unknown protocol "), LENSTR(protocol.ptr, protocol.len), STR(" for serial "), D8(serial));
     }
@@ -42,7 +79,7 @@ static void cmd_serial(terminal_t *term, token_t cmdline) {
 static command_t command_serial = {
     .next = NULL,
     .name = "serial",
-    .help = "serial <portnum> <protocol>",
+    .help = "serial <portnum> <protocol> [<options>...]",
     .cmd = cmd_serial,
 };
 
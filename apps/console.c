@@ -10,6 +10,7 @@
 #include "token.h"
 #include "tty.h"
 #include <stddef.h>
+#include <string.h>
 
 static uint8_t console_buf[1024] = {0, };
 static uint8_t *console_ptr = &console_buf[0];
@@ -38,3 +39,27 @@ void console_recv_byte(uint8_t device, uint8_t ch) {
     }
 }
 
+
+static const uint8_t *find_eol(const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (buf[i] == '\r' || buf[i] == '\n')
+            return &buf[i];
+    }
+    return NULL;
+}
+
+void console_recv_bytes(uint8_t device, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        const uint8_t *eol = find_eol(buf, len);
+        size_t run = eol ? (size_t)(eol - buf) : len;
+        size_t space = sizeof(console_buf) - console_len();
+        size_t copy = run < space ? run : space;
+        memcpy(console_ptr, buf, copy);
+        console_ptr += copy;
+        if (!eol)
+            return;
+        console_recv_byte(device, *eol);
+        buf += run + 1;
+        len -= run + 1;
+    }
+}
@@ -5,8 +5,11 @@
  */
 #ifndef CONSOLE_H
 #define CONSOLE_H
+#include <stddef.h>
 #include <stdint.h>
 
 void console_recv_byte(uint8_t device, uint8_t ch);
+/* Receive a block of bytes, a line at a time */
+void console_recv_bytes(uint8_t device, const uint8_t *buf, size_t len);
 
 #endif
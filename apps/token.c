@@ -75,6 +75,23 @@ bool token_get_u8(token_t *source, uint8_t *dest) {
     return ret;
 }
 
+bool token_get_u16(token_t *source, uint16_t *dest) {
+    bool ret = false;
+    uint8_t ch;
+    *dest = 0;
+    skipwhite(source);
+    while (token_peek_byte(*source, &ch) && ch >= '0' && ch <= '9') {
+        if (!token_get_byte(source, &ch))
+            return false;
+        if (*dest > (UINT16_MAX - (ch - '0')) / 10)
+            return false;
+        *dest = *dest * 10 + (ch - '0');
+        ret = true; /* We consumed at least one digit */
+    }
+
+    return ret;
+}
+
 static inline bool is_whitespace(uint8_t ch) {
     return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
@@ -34,6 +34,8 @@ ssize_t token_cmp(const token_t lhs, const token_t rhs);
 
 /* Read a uint8_t from the token, returning false on failure */
 bool token_get_u8(token_t *source, uint8_t *dest);
+/* Read a uint16_t from the token, returning false on failure */
+bool token_get_u16(token_t *source, uint16_t *dest);
 
 bool token_get_ssid(token_t *source, ssid_t *ssid);
 
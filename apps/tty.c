@@ -88,7 +88,8 @@ void terminal_tx(terminal_t *term, token_t data) {
             memcpy(&buf[1], data.ptr, data.len);
             buf[data.len+1] = '\r';
 
-            dl_send(term->sock, buf, data.len+2);
+            if (dl_send(term->sock, buf, data.len+2) == DL_SEND_BUSY)
+                DEBUG(STR("tty: connection busy, dropping line"));
             return;
         }
         case TERM_SERIAL:
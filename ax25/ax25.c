@@ -8,9 +8,9 @@
 #include "capture.h"
 #include "connection.h"
 #include "debug.h"
+#include "frame.h"
 #include "kiss.h"
 #include "metric.h"
-#include "packet.h"
 #include "ssid.h"
 
 /* AX.25 packet
@@ -21,22 +21,6 @@
  * +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+...
  */
 
-enum {
-    CONTROL8_I_MASK =  0b00000001, /* Mask to recognise I frames */
-    CONTROL8_SU_MASK = 0b00000011, /* Mask to recognise S or U frames */
-    CONTROL8_NS_MASK = 0b00001110, /* Mask for NS field in I frames */
-    CONTROL8_S_MASK  = 0b00001100, /* Mask for S field in S frames */
-    CONTROL8_PF_MASK = 0b00010000, /* Mask for P/F bit */
-    CONTROL8_NR_MASK = 0b11100000, /* Mask for NR field in I/S frames */
-    CONTROL8_M_MASK  = 0b11101100, /* Mask for M field in U frames */
-
-    CONTROL16_NR_MASK = 0b1111111000000000,
-    CONTROL16_PF_MASK = 0b0000000100000000,
-    CONTROL16_NS_MASK = 0b0000000011111110,
-    CONTROL16_S_MASK  = 0b0000000000001100,
-    CONTROL16_I_MASK  = 0b0000000000000001,
-};
-
 /* Address 0 and 1 have a C bit, address 2 and 3 have an H bit */
 static bool get_ch_bit(const uint8_t pkt[], size_t pktlen, size_t addrnum) {
     size_t offset = addrnum * SSID_LEN + SSID_LEN-1;
@@ -57,34 +41,53 @@ static size_t get_active_destination(const uint8_t pkt[], size_t pktlen, size_t
     return ADDR_DST;
 }
 
-/* Look at the next byte in the packet, without changing the offset.
- * returns false if the packet is truncated.
+/* Could this frame be for us?
+ *
+ * Finds the active destination straight from the raw address field, and
+ * checks it against our local ssids.  Malformed frames are passed on, so the
+ * full parser can account for them.
  */
-static bool pkt_peek(const uint8_t pkt[], size_t pktlen, const size_t *offset, uint8_t *byte) {
-    if (*offset < pktlen) {
-        *byte = pkt[*offset];
-        return true;
-    } else {
-        return false;
+static bool maybe_for_me(const uint8_t pkt[], size_t pktlen) {
+    size_t active = ADDR_DST;
+    size_t addr;
+    for (addr = 0; ; ++addr) {
+        size_t offset = addr * SSID_LEN;
+        if (addr >= MAX_ADDRESSES || pktlen - offset < SSID_LEN)
+            return true;
+        uint8_t last = pkt[offset + SSID_LEN-1];
+        if (addr >= ADDR_DIGI1 && active == ADDR_DST && (last & 0b10000000) == 0)
+            active = addr;
+        if ((last & 0x01) == 0b01)
+            break;
     }
-}
-
-static bool is_i_frame8(uint8_t control) {
-    return (control & CONTROL8_I_MASK) == 0b0;
-}
-
-static bool is_i_frame16(uint16_t control) {
-    return (control & CONTROL16_I_MASK) == 0b0;
-}
+    /* No source address */
+    if (addr < ADDR_SRC)
+        return true;
 
-static bool is_u_frame8(uint8_t control) {
-    return (control & CONTROL8_SU_MASK) == 0b11;
+    ssid_t dst;
+    if (!ssid_parse(&pkt[active * SSID_LEN], &dst))
+        return true;
+    return dl_maybe_local(&dst);
 }
 
 void ax25_recv_ackmode(uint8_t port, uint16_t id, const uint8_t pkt[], size_t pktlen) {
-    (void) id;
     ax25_dl_event_t ev;
 
+    if (id != 0 && pktlen == 0) {
+        /* ACKMODE acknowledgement, the TNC has transmitted frame "id". */
+        dl_xmit_complete(port, id);
+        return;
+    }
+
+    /* On a shared channel most frames aren't for us, so drop those before
+     * doing any real work. */
+    if (!maybe_for_me(pkt, pktlen)) {
+        capture_trigger(DIR_OTHER, pkt, pktlen);
+        metric_inc(METRIC_NOT_ME);
+        metric_inc_by(METRIC_NOT_ME_BYTES, pktlen);
+        return;
+    }
+
     ev.port = port;
     ev.address_count = 0;
     ev.conn = NULL;
@@ -151,98 +154,29 @@ void ax25_recv_ackmode(uint8_t port, uint16_t id, const uint8_t pkt[], size_t pk
             | (get_ch_bit(pkt, pktlen, ADDR_SRC) ? 0b10 : 0b00);
 
     ev.conn = conn_find(&ev.address[ADDR_DST], &ev.address[ADDR_SRC], ev.port);
+    if (ev.conn) {
+        /* Tell the peer to hold off before accepting anything else from it */
+        dl_update_pool_busy(ev.conn);
+    }
 
-    uint8_t control;
-    if (!pkt_peek(pkt, pktlen, &offset, &control)) {
+    /* S and I frames need the connection to know if the control field is 8
+     * or 16 bits long, U frames are always 8 bits */
+    frame_desc_t frame;
+    if (!frame_decode(&pkt[offset], pktlen - offset, conn_is_extended(ev.conn), &frame)) {
         capture_trigger(DIR_IN, pkt, pktlen);
         metric_inc(METRIC_UNDERRUN);
         return;
     }
-    if (is_u_frame8(control)) {
-        /* unconnected frames always have an 8 bit control field */
-        if (ev.type == TYPE_CMD) {
-            ev.p = (control & CONTROL8_PF_MASK) != 0;
-            ev.f = 0;
-        }
-        else {
-            ev.f = (control & CONTROL8_PF_MASK) != 0;
-            ev.p = 0;
-        }
-        switch (control & 0b11101100) {
-            case 0b00101100: ev.event = EV_SABM; break;
-            case 0b01101100: ev.event = EV_SABME; break;
-            case 0b01000000: ev.event = EV_DISC; break;
-            case 0b00001100: ev.event = EV_DM; break;
-            case 0b01100000: ev.event = EV_UA; break;
-            case 0b10000100: ev.event = EV_FRMR; break;
-            case 0b00000000: ev.event = EV_UI; break;
-            case 0b10101100: ev.event = EV_XID; break;
-            case 0b11100000: ev.event = EV_TEST; break;
-            default:
-                             DEBUG(STR("Unknown uframe, control="), X8(control));
-                             ev.event = EV_UNKNOWN_FRAME;
-                             break;
-        }
-    } else {
-        /* both S and I frames are connected, and we need to know the
-         * connection to know if control is 8 or 16 bits long */
-        bool extended = false;
-        extended = conn_is_extended(ev.conn);
-        offset++;
-        if (extended) {
-            uint16_t control16 = (pkt[offset++] << 8) | control;
-            if (ev.type == TYPE_CMD) {
-                ev.p = (control16 & CONTROL16_PF_MASK) != 0;
-                ev.f = 0;
-            } else {
-                ev.f = (control16 & CONTROL16_PF_MASK) != 0;
-                ev.p = 0;
-            }
+    offset += frame.len;
+
+    ev.event = frame.event;
+    ev.p = frame.pf && ev.type == TYPE_CMD;
+    ev.f = frame.pf && ev.type != TYPE_CMD;
+    ev.nr = frame.nr;
+    ev.ns = frame.ns;
+    if (ev.event == EV_UNKNOWN_FRAME)
+        DEBUG(STR("Unknown frame, control="), X8(pkt[offset - 1]));
 
-            ev.nr = (control16 & CONTROL16_NR_MASK) >> 9;
-            if (is_i_frame16(control16)) {
-                ev.ns = (control16 & CONTROL16_NS_MASK) >> 1;
-                ev.event = EV_I;
-            } else {
-                /* S Frame */
-                switch (control16 & CONTROL16_S_MASK) {
-                    case 0b00000000: ev.event = EV_RR; break;
-                    case 0b00000100: ev.event = EV_RNR; break;
-                    case 0b00001000: ev.event = EV_REJ; break;
-                    case 0b00001100: ev.event = EV_SREJ; break;
-                    default:
-                                     ev.event = EV_UNKNOWN_FRAME;
-                                     DEBUG(STR("Unknown sframe, control="), X8(control16));
-                                     break;
-                }
-            }
-        } else {
-            if (ev.type == TYPE_CMD) {
-                ev.p = (control & CONTROL8_PF_MASK) != 0;
-                ev.f = 0;
-            } else {
-                ev.f = (control & CONTROL8_PF_MASK) != 0;
-                ev.p = 0;
-            }
-            ev.nr = control >> 5;
-            if (is_i_frame8(control)) {
-                ev.ns = (control & CONTROL8_NS_MASK) >> 1;
-                ev.event = EV_I;
-            } else {
-                /* S Frame */
-                switch (control & CONTROL8_S_MASK) {
-                    case 0b00000000: ev.event = EV_RR; break;
-                    case 0b00000100: ev.event = EV_RNR; break;
-                    case 0b00001000: ev.event = EV_REJ; break;
-                    case 0b00001100: ev.event = EV_SREJ; break;
-                    default:
-                                     ev.event = EV_UNKNOWN_FRAME;
-                                     DEBUG(STR("Unknown sframe, control="), X8(control));
-                                     break;
-                }
-            }
-        }
-    }
     ev.info = &pkt[offset];
     ev.info_len = pktlen - offset;
 
@@ -60,7 +60,10 @@
 #include "buffer.h"
 #include "config.h"
 #include "debug.h"
+#include "hash_index.h"
 #include "kiss.h"
+#include "platform.h"
+#include <string.h> // for memcpy
 
 static duration_t default_srtt(void) {
     return duration_millis(200);
@@ -68,131 +71,305 @@ static duration_t default_srtt(void) {
 
 static dl_socket_t dl_sockets[MAX_SOCKETS];
 
+/* Sockets live in dl_sockets, then in slabs of SOCKET_SLAB grown with
+ * platform_alloc() once it's full.  Like connections, they never move.
+ */
+typedef struct socket_slab_t {
+    struct socket_slab_t *next;
+    dl_socket_t *sockets;
+    size_t count;
+} socket_slab_t;
+
+static socket_slab_t socket_slabs = { .next = NULL, .sockets = dl_sockets, .count = MAX_SOCKETS };
+static socket_slab_t *socket_slabs_tail = &socket_slabs;
+static size_t socket_count = MAX_SOCKETS;
+
+/* Closed sockets, so finding one doesn't mean walking every slab.
+ * dl_sockets goes on the first time it's needed.
+ */
+static dl_socket_t *socket_free_list = NULL;
+static bool dl_sockets_on_free_list = false;
+
+static void socket_push_free_slab(dl_socket_t *sockets, size_t count) {
+    /* Backwards, so they're handed out in order */
+    for(size_t i = count; i > 0; --i) {
+        sockets[i - 1].next_free = socket_free_list;
+        socket_free_list = &sockets[i - 1];
+    }
+}
+
+/* Sockets are indexed two ways: connected sockets by (local, remote), and
+ * listeners by local (including any wildcard SSID).
+ */
+typedef struct socket_key_t {
+    const ssid_t *local;
+    const ssid_t *remote;
+} socket_key_t;
+
+static uint32_t connected_hash(const void *entry) {
+    const dl_socket_t *socket = entry;
+    return ssid_hash(ssid_hash(HASH_INIT, &socket->local), &socket->remote);
+}
+
+static bool connected_match(const void *entry, const void *key) {
+    const dl_socket_t *socket = entry;
+    const socket_key_t *k = key;
+    return ssid_cmp(&socket->local, k->local) == 0
+        && ssid_cmp(&socket->remote, k->remote) == 0;
+}
+
+static uint32_t listener_hash(const void *entry) {
+    const dl_socket_t *socket = entry;
+    return ssid_hash(HASH_INIT, &socket->local);
+}
+
+static bool listener_match(const void *entry, const void *key) {
+    const dl_socket_t *socket = entry;
+    return ssid_cmp(&socket->local, key) == 0;
+}
+
+static void *connected_slots[2 * MAX_SOCKETS];
+static hash_index_t connected_index = {
+    .slots = connected_slots,
+    .size = 2 * MAX_SOCKETS,
+    .hash = connected_hash,
+};
+
+static void *listener_slots[2 * MAX_SOCKETS];
+static hash_index_t listener_index = {
+    .slots = listener_slots,
+    .size = 2 * MAX_SOCKETS,
+    .hash = listener_hash,
+};
+
+/* Counting Bloom filter over the local ssid of every socket, so that frames
+ * for other stations can be rejected without parsing them.  Each ssid
+ * increments two counters; an ssid is possibly local only if both of its
+ * counters are non-zero.
+ */
+enum { LOCAL_FILTER_SIZE = 256 };
+static uint16_t local_filter[LOCAL_FILTER_SIZE];
+
+static void local_filter_update(const ssid_t *local, int delta) {
+    uint32_t hash = ssid_hash(HASH_INIT, local);
+    local_filter[hash % LOCAL_FILTER_SIZE] += delta;
+    local_filter[(hash >> 8) % LOCAL_FILTER_SIZE] += delta;
+}
+
+static bool local_filter_check(const ssid_t *ssid) {
+    uint32_t hash = ssid_hash(HASH_INIT, ssid);
+    return local_filter[hash % LOCAL_FILTER_SIZE] != 0
+        && local_filter[(hash >> 8) % LOCAL_FILTER_SIZE] != 0;
+}
+
+bool dl_maybe_local(const ssid_t *ssid) {
+    if (local_filter_check(ssid))
+        return true;
+    ssid_t wildcard = *ssid;
+    wildcard.ssid[SSID_LEN-1] = SSID_WILDCARD;
+    return local_filter_check(&wildcard);
+}
+
+/* Move a socket index into slots for size sockets */
+static bool socket_index_grow(hash_index_t *index, void **static_slots, size_t size) {
+    void **slots = platform_alloc(2 * size * sizeof(*slots));
+    if (!slots)
+        return false;
+    void **old_slots = index->slots;
+    hash_index_resize(index, slots, 2 * size);
+    if (old_slots != static_slots)
+        platform_free(old_slots);
+    return true;
+}
+
+/* Add a slab of sockets to the free list.  Returns false if there's no
+ * memory.
+ */
+static bool socket_grow(void) {
+    size_t count = socket_count + SOCKET_SLAB;
+    if (!socket_index_grow(&connected_index, connected_slots, count)
+            || !socket_index_grow(&listener_index, listener_slots, count))
+        return false;
+
+    socket_slab_t *slab = platform_alloc(sizeof(*slab));
+    dl_socket_t *sockets = platform_alloc(SOCKET_SLAB * sizeof(*sockets));
+    if (!slab || !sockets) {
+        platform_free(slab);
+        platform_free(sockets);
+        return false;
+    }
+    /* platform_alloc() zeroes, so they all start out DL_SOCK_CLOSED */
+    slab->sockets = sockets;
+    slab->count = SOCKET_SLAB;
+    socket_slabs_tail->next = slab;
+    socket_slabs_tail = slab;
+    socket_count = count;
+    socket_push_free_slab(sockets, SOCKET_SLAB);
+    return true;
+}
+
+static dl_socket_t *socket_find_free(void) {
+    if (!dl_sockets_on_free_list) {
+        socket_push_free_slab(dl_sockets, MAX_SOCKETS);
+        dl_sockets_on_free_list = true;
+    }
+    if (!socket_free_list && !socket_grow())
+        return NULL;
+    dl_socket_t *socket = socket_free_list;
+    socket_free_list = socket->next_free;
+    return socket;
+}
+
 static dl_socket_t *socket_allocate(connection_t *conn, dl_socket_type_t type, ssid_t *local) {
-    for(size_t i = 0; i < MAX_SOCKETS; ++i) {
-        if (dl_sockets[i].type == DL_SOCK_CLOSED) {
-            dl_sockets[i] = (dl_socket_t) {
-                .type = type,
-                .conn = conn,
-                .local = *local,
-                .userdata = NULL,
-                .on_connect = NULL,
-                .on_error = NULL,
-                .on_data = NULL,
-                .on_disconnect = NULL,
-            };
-            if (conn)
-                conn->socket = &dl_sockets[i];
-            return &dl_sockets[i];
-         }
-    }
-    return NULL;
+    dl_socket_t *socket = socket_find_free();
+    if (!socket)
+        return NULL;
+
+    *socket = (dl_socket_t) {
+        .type = type,
+        .conn = conn,
+        .local = *local,
+        .userdata = NULL,
+        .on_connect = NULL,
+        .on_error = NULL,
+        .on_data = NULL,
+        .on_disconnect = NULL,
+    };
+    if (conn) {
+        conn->socket = socket;
+        socket->remote = conn->remote;
+    }
+    if (type == DL_SOCK_CONNECTED)
+        hash_index_insert(&connected_index, socket);
+    else
+        hash_index_insert(&listener_index, socket);
+    local_filter_update(local, +1);
+    return socket;
 }
 
 static void socket_free(dl_socket_t *socket) {
+    if (socket->type == DL_SOCK_CONNECTED)
+        hash_index_remove(&connected_index, socket);
+    else
+        hash_index_remove(&listener_index, socket);
+    local_filter_update(&socket->local, -1);
     socket->conn->socket = NULL;
     socket->type = DL_SOCK_CLOSED;
     socket->conn = NULL;
-    socket = NULL;
+    socket->next_free = socket_free_list;
+    socket_free_list = socket;
 }
 
-/* This iterates through all the sockets, if there's a connected socket with
- * the correct (local, remote) pair, then return that, if not, then if there's
- * a listening socket with the correct local ssid, return that, otherwise
- * return NULL.
+static dl_socket_t *find_listener(const ssid_t *local) {
+    return hash_index_find(&listener_index, ssid_hash(HASH_INIT, local), listener_match, local);
+}
+
+/* If there's a connected socket with the correct (local, remote) pair, then
+ * return that, if not, then if there's a listening socket with the correct
+ * local ssid, return that, then a listener for any ssid of local's callsign,
+ * otherwise return NULL.
  */
 dl_socket_t *dl_find_socket(ssid_t *local, ssid_t *remote) {
-    dl_socket_t *socket = NULL;
-    for(size_t i = 0; i < MAX_SOCKETS; ++i) {
-        switch (dl_sockets[i].type) {
-            case DL_SOCK_LISTEN:
-                if (ssid_cmp(local, &dl_sockets[i].local) == 0)
-                    socket = &dl_sockets[i];
-                break;
-            case DL_SOCK_CONNECTED:
-                if (remote
-                        && ssid_cmp(local, &dl_sockets[i].local) == 0
-                        && ssid_cmp(remote, &dl_sockets[i].conn->remote) == 0)
-                    return &dl_sockets[i];
-                break;
-            case DL_SOCK_CLOSED:
-                continue;
-        }
+    if (remote) {
+        socket_key_t key = { .local = local, .remote = remote };
+        dl_socket_t *socket = hash_index_find(&connected_index,
+                ssid_hash(ssid_hash(HASH_INIT, local), remote), connected_match, &key);
+        if (socket)
+            return socket;
     }
-    return socket;
+
+    dl_socket_t *socket = find_listener(local);
+    if (socket)
+        return socket;
+
+    ssid_t wildcard = *local;
+    wildcard.ssid[SSID_LEN-1] = SSID_WILDCARD;
+    return find_listener(&wildcard);
 }
 
 dl_socket_t *dl_find_or_add_listener(ssid_t *name) {
-    dl_socket_t *listener = dl_find_socket(name, NULL);
+    dl_socket_t *listener = find_listener(name);
     if (listener)
         return listener;
     return socket_allocate(NULL, DL_SOCK_LISTEN, name);
 }
 
-static void push_reply_addrs(ax25_dl_event_t *ev, packet_t *pkt, type_t type) {
-    pkt->port = ev->conn ? ev->conn->port : ev->port;
+/* Frames are built back to front: the payload (if any) goes into the buffer
+ * first, then the control field and the address field are prepended into the
+ * buffer's headroom.
+ */
+static void prepend_reply_addrs(ax25_dl_event_t *ev, buffer_t *pkt, type_t type) {
+    if (ev->conn && (type == TYPE_CMD || type == TYPE_RES)) {
+        /* Connections keep their address field ready encoded */
+        memcpy(buffer_prepend(pkt, ev->conn->addrs_len), ev->conn->addrs[type == TYPE_CMD], ev->conn->addrs_len);
+        return;
+    }
+
+    uint8_t addrs[MAX_ADDRESSES * SSID_LEN];
+    size_t len = 0;
     if (ev->address_count) {
-        ssid_push(pkt, &ev->address[ADDR_SRC]);
-        ssid_push(pkt, &ev->address[ADDR_DST]);
+        ssid_encode(&ev->address[ADDR_SRC], &addrs[len]);
+        len += SSID_LEN;
+        ssid_encode(&ev->address[ADDR_DST], &addrs[len]);
+        len += SSID_LEN;
 
         /* Add digipeater addresses in reverse order */
         for(size_t i=ev->address_count-1; i>=ADDR_DIGI1; i--) {
-            ssid_push(pkt, &ev->address[i]);
+            ssid_encode(&ev->address[i], &addrs[len]);
+            len += SSID_LEN;
         }
     } else {
-        ssid_push(pkt, &ev->conn->remote);
-        ssid_push(pkt, &ev->conn->local);
+        ssid_encode(&ev->conn->remote, &addrs[len]);
+        len += SSID_LEN;
+        ssid_encode(&ev->conn->local, &addrs[len]);
+        len += SSID_LEN;
         /* TODO: no digipeaters? */
     }
 
     /* add end of addresses marker */
-    pkt->buffer[pkt->len-1] |= 0b00000001;
+    addrs[len-1] |= 0b00000001;
 
-    pkt->buffer[SSID_LEN-1] |= (type & 0b01) != 0 ?  0b10000000 : 0;
-    pkt->buffer[2*SSID_LEN-1] |= (type & 0b10) != 0 ? 0b10000000 : 0;
+    addrs[SSID_LEN-1] |= (type & 0b01) != 0 ?  0b10000000 : 0;
+    addrs[2*SSID_LEN-1] |= (type & 0b10) != 0 ? 0b10000000 : 0;
+
+    memcpy(buffer_prepend(pkt, len), addrs, len);
 }
 
-static void push_u_control(packet_t *pkt, uint8_t cmd, type_t type, bool p, bool f) {
+static void prepend_u_control(buffer_t *pkt, uint8_t cmd, type_t type, bool p, bool f) {
     if (type == TYPE_RES) {
         cmd |= (f ? FRAME_F : 0);
     } else {
         cmd |= (p ? FRAME_P : 0);
     }
-    packet_push_byte(pkt, cmd);
+    *buffer_prepend(pkt, 1) = cmd;
 }
 
-static void push_s_control(packet_t *pkt, uint8_t modulo, uint8_t cmd, type_t type, bool p, bool f, uint8_t nr) {
+/* pf is P for commands, and F for responses */
+static void prepend_s_control(buffer_t *pkt, uint8_t modulo, uint8_t cmd, bool pf, uint8_t nr) {
     if (modulo == 8) {
-        if (type == TYPE_RES) {
-            cmd |= (f ? FRAME_F : 0);
-        } else {
-            cmd |= (p ? FRAME_P : 0);
-        }
+        cmd |= (pf ? FRAME_P : 0);
         cmd |= (nr << 5) & 0b11100000;
-        packet_push_byte(pkt, cmd);
+        *buffer_prepend(pkt, 1) = cmd;
     }
     else {
         uint16_t ctl = 0;
-        if (type == TYPE_RES) {
-            ctl |= (f ? FRAME16_F : 0);
-        } else {
-            ctl |= (p ? FRAME16_P : 0);
-        }
+        ctl |= (pf ? FRAME16_P : 0);
         ctl |= (nr << 9) & 0b1111111000000000;
         ctl |= cmd;
 
-        packet_push_byte(pkt, ctl & 0xFF);
-        packet_push_byte(pkt, ctl >> 8);
+        uint8_t *p = buffer_prepend(pkt, 2);
+        p[0] = ctl & 0xFF;
+        p[1] = ctl >> 8;
     }
 }
 
-static void push_i_control(packet_t *pkt, uint8_t modulo, bool p, uint8_t nr, uint8_t ns) {
+static void prepend_i_control(buffer_t *pkt, uint8_t modulo, bool p, uint8_t nr, uint8_t ns) {
     if (modulo == 8) {
         uint8_t ctl = 0;
         ctl |= (p ? FRAME_P : 0);
         ctl |= (nr << 5) & 0b11100000;
         ctl |= (ns << 1) & 0b00001110;
-        packet_push_byte(pkt, ctl);
+        *buffer_prepend(pkt, 1) = ctl;
     }
     else {
         uint16_t ctl = 0;
@@ -200,145 +377,174 @@ static void push_i_control(packet_t *pkt, uint8_t modulo, bool p, uint8_t nr, ui
         ctl |= (nr << 9) & 0b1111111000000000;
         ctl |= (ns << 1) & 0b0000000011111110;
 
-        packet_push_byte(pkt, ctl & 0xFF);
-        packet_push_byte(pkt, ctl >> 8);
+        uint8_t *b = buffer_prepend(pkt, 2);
+        b[0] = ctl & 0xFF;
+        b[1] = ctl >> 8;
     }
 }
 
+/* Transmit a frame.
+ *
+ * If the port is in ACKMODE, remember the id so that T1 can be restarted once
+ * the TNC has actually sent the frame, rather than when it was queued.
+ */
+static void dl_xmit(ax25_dl_event_t *ev, buffer_t *pkt) {
+    uint16_t id = kiss_xmit(ev->conn ? ev->conn->port : ev->port, pkt->buffer, pkt->len);
+    if (ev->conn && id != 0)
+        conn_set_xmit_id(ev->conn, id);
+}
+
 static void send_dm(ax25_dl_event_t *ev, bool f, bool expedited) {
     (void) expedited;
     //DEBUG(STR("sending dm"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, TYPE_RES);
-    push_u_control(pkt, FRAME_DM, TYPE_RES, ev->p, f);
+    prepend_u_control(pkt, FRAME_DM, TYPE_RES, ev->p, f);
+    prepend_reply_addrs(ev, pkt, TYPE_RES);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
 static void send_ui(ax25_dl_event_t *ev, type_t type) {
     //DEBUG(STR("sending ui"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, type);
-    push_u_control(pkt, FRAME_UI, type, ev->p, ev->f);
+    prepend_u_control(pkt, FRAME_UI, type, ev->p, ev->f);
+    prepend_reply_addrs(ev, pkt, type);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
 static void send_ua(ax25_dl_event_t *ev, bool expedited) {
     (void) expedited;
     //DEBUG(STR("sending ua"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, TYPE_RES);
-    push_u_control(pkt, FRAME_UA, TYPE_RES, ev->p, ev->f);
+    prepend_u_control(pkt, FRAME_UA, TYPE_RES, ev->p, ev->f);
+    prepend_reply_addrs(ev, pkt, TYPE_RES);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
 static void send_sabm(ax25_dl_event_t *ev, bool f) {
     //DEBUG(STR("sending sabm"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, TYPE_CMD);
-    push_u_control(pkt, FRAME_SABM, TYPE_CMD, ev->p, f);
+    prepend_u_control(pkt, FRAME_SABM, TYPE_CMD, ev->p, f);
+    prepend_reply_addrs(ev, pkt, TYPE_CMD);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
 static void send_sabme(ax25_dl_event_t *ev, bool f) {
     //DEBUG(STR("sending sabme"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, TYPE_CMD);
-    push_u_control(pkt, FRAME_SABME, TYPE_CMD, ev->p, f);
+    prepend_u_control(pkt, FRAME_SABME, TYPE_CMD, ev->p, f);
+    prepend_reply_addrs(ev, pkt, TYPE_CMD);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
 static void send_disc(ax25_dl_event_t *ev, bool f) {
     //DEBUG(STR("sending disc"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, TYPE_CMD);
-    push_u_control(pkt, FRAME_DISC, TYPE_CMD, ev->p, f);
+    prepend_u_control(pkt, FRAME_DISC, TYPE_CMD, ev->p, f);
+    prepend_reply_addrs(ev, pkt, TYPE_CMD);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
 static void send_test(ax25_dl_event_t *ev, type_t type, bool f) {
     //DEBUG(STR("sending test"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate(ev->info, ev->info_len);
+    if (!pkt)
+        return;
 
-    push_reply_addrs(ev, pkt, type);
-    push_u_control(pkt, FRAME_TEST, type, ev->p, f);
-    packet_push(pkt, ev->info, ev->info_len);
+    prepend_u_control(pkt, FRAME_TEST, type, ev->p, f);
+    prepend_reply_addrs(ev, pkt, type);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
-static void send_srej(ax25_dl_event_t *ev, type_t type) {
+static void send_srej(ax25_dl_event_t *ev, type_t type, bool pf) {
     //DEBUG(STR("sending srej"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, type);
-    push_s_control(pkt, ev->conn->modulo, FRAME_SREJ, type, ev->p, ev->f, ev->conn->rcv_state);
+    prepend_s_control(pkt, ev->conn->hot.modulo, FRAME_SREJ, pf, ev->conn->hot.rcv_state);
+    prepend_reply_addrs(ev, pkt, type);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
-static void send_rej(ax25_dl_event_t *ev, type_t type) {
+static void send_rej(ax25_dl_event_t *ev, type_t type, bool pf) {
     //DEBUG(STR("sending rej"));
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, type);
-    push_s_control(pkt, ev->conn->modulo, FRAME_REJ, TYPE_RES, ev->p, ev->f, ev->conn->rcv_state);
+    prepend_s_control(pkt, ev->conn->hot.modulo, FRAME_REJ, pf, ev->conn->hot.rcv_state);
+    prepend_reply_addrs(ev, pkt, type);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
-static void send_rr(ax25_dl_event_t *ev, type_t type, bool f) {
+static void send_rr(ax25_dl_event_t *ev, type_t type, bool pf) {
     //DEBUG(STR("sending rr"));
 
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, type);
-    push_s_control(pkt, ev->conn->modulo, FRAME_RR, type, ev->p, f, ev->conn->rcv_state);
+    prepend_s_control(pkt, ev->conn->hot.modulo, FRAME_RR, pf, ev->conn->hot.rcv_state);
+    prepend_reply_addrs(ev, pkt, type);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
-static void send_rnr(ax25_dl_event_t *ev, type_t type, bool f) {
+static void send_rnr(ax25_dl_event_t *ev, type_t type, bool pf) {
     //DEBUG(STR("sending rnr"));
 
-    packet_t *pkt = packet_allocate();
+    buffer_t *pkt = buffer_allocate_with_size(BUFFER_HEADROOM);
+    if (!pkt)
+        return; /* Out of buffers, the frame is lost as if on the air */
 
-    push_reply_addrs(ev, pkt, type);
-    push_s_control(pkt, ev->conn->modulo, FRAME_RNR, type, ev->p, f, ev->conn->rcv_state);
+    prepend_s_control(pkt, ev->conn->hot.modulo, FRAME_RNR, pf, ev->conn->hot.rcv_state);
+    prepend_reply_addrs(ev, pkt, type);
 
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
-    packet_free(&pkt);
+    dl_xmit(ev, pkt);
+    buffer_free(&pkt);
 }
 
-static packet_t *construct_i(ax25_dl_event_t *ev, uint8_t *info, size_t info_len, uint8_t nr) {
-    packet_t *pkt = packet_allocate();
-
-    push_reply_addrs(ev, pkt, TYPE_CMD);
-    push_i_control(pkt, ev->conn->modulo, ev->p, nr, ev->conn->snd_state);
-    packet_push(pkt, info, info_len);
-
-    return pkt;
+/* Turn a queued payload into an I frame, in place */
+static void construct_i(ax25_dl_event_t *ev, buffer_t *pkt, uint8_t nr) {
+    prepend_i_control(pkt, ev->conn->hot.modulo, ev->p, nr, ev->conn->hot.snd_state);
+    prepend_reply_addrs(ev, pkt, TYPE_CMD);
 }
 
 static void dl_error(ax25_dl_event_t *ev, ax25_dl_error_t err) {
@@ -385,17 +591,45 @@ dl_socket_t *dl_connect(ssid_t *remote, ssid_t *local, uint8_t port) {
     ev.conn = NULL;
     ev.socket = NULL;
     ax25_dl_event(&ev);
-    return ev.conn ? socket_allocate(ev.conn, DL_SOCK_CONNECTED, local) : NULL;
+    /* EV_DL_CONNECT allocates the socket */
+    return ev.conn ? ev.conn->socket : NULL;
 }
 
-void dl_send(dl_socket_t *sock, const void *data, size_t datalen) {
+dl_send_result_t dl_send(dl_socket_t *sock, const void *data, size_t datalen) {
+    /* Leave the last few buffers for acks and retransmissions */
+    if (buffer_pool_low())
+        return DL_SEND_BUSY;
+
     ax25_dl_event_t ev;
     ev.event = EV_DL_DATA;
     ev.conn = sock->conn;
     ev.info = data;
     ev.info_len = datalen;
+    ev.packet = buffer_allocate(data, datalen);
+    if (!ev.packet)
+        return DL_SEND_BUSY;
+
+    ax25_dl_event(&ev);
+
+    /* Not queued in this state */
+    if (ev.packet)
+        buffer_free(&ev.packet);
+    return DL_SEND_OK;
+}
+
+void dl_update_pool_busy(connection_t *conn) {
+    bool low = buffer_pool_low();
+    if (conn->hot.pool_busy == low)
+        return;
 
+    ax25_dl_event_t ev;
+    ev.event = low ? EV_DL_FLOW_OFF : EV_DL_FLOW_ON;
+    ev.conn = conn;
+    ev.address_count = 0;
     ax25_dl_event(&ev);
+    /* Links that aren't up yet ignore flow control, so only count it once
+     * it's taken effect, and it's tried again on the next frame */
+    conn->hot.pool_busy = conn->hot.self_busy;
 }
 
 static void mdl_negotiate_request(ax25_dl_event_t *ev) {
@@ -404,20 +638,21 @@ static void mdl_negotiate_request(ax25_dl_event_t *ev) {
 }
 
 static buffer_t *pop_queue(connection_t *conn) {
-    if (!conn->send_queue_head)
+    if (!conn->hot.send_queue_head)
         return NULL;
 
-    buffer_t *ret = conn->send_queue_head;
-    conn->send_queue_head = conn->send_queue_head->next;
-    if (!conn->send_queue_head) {
-        conn->send_queue_tail = NULL;
+    buffer_t *ret = conn->hot.send_queue_head;
+    conn->hot.send_queue_head = conn->hot.send_queue_head->next;
+    ret->next = NULL;
+    if (!conn->hot.send_queue_head) {
+        conn->hot.send_queue_tail = NULL;
     }
 
     return ret;
 }
 
 static void discard_queue(connection_t *conn) {
-    while (conn->send_queue_head) {
+    while (conn->hot.send_queue_head) {
         buffer_t *buf = pop_queue(conn);
         buffer_free(&buf);
     }
@@ -426,24 +661,32 @@ static void discard_queue(connection_t *conn) {
 static void push_i(connection_t *conn, buffer_t *buffer) {
     CHECK(!buffer->next);
 
-    if (conn->send_queue_tail) {
-        CHECK(conn->send_queue_head);
-        conn->send_queue_tail->next = buffer;
-        conn->send_queue_tail = buffer;
+    if (conn->hot.send_queue_tail) {
+        CHECK(conn->hot.send_queue_head);
+        conn->hot.send_queue_tail->next = buffer;
+        conn->hot.send_queue_tail = buffer;
     } else {
-        CHECK(!conn->send_queue_head);
-        conn->send_queue_tail = buffer;
-        conn->send_queue_head = buffer;
+        CHECK(!conn->hot.send_queue_head);
+        conn->hot.send_queue_tail = buffer;
+        conn->hot.send_queue_head = buffer;
     }
 }
 
-static void push_old_i_frame_nr_on_queue(ax25_dl_event_t *ev) {
-    packet_t *pkt = ev->conn->sent_buffer[ev->nr];
-    kiss_xmit(pkt->port, pkt->buffer, pkt->len);
+/* Queue the data from dl_send(), taking over its buffer */
+static void queue_dl_data(ax25_dl_event_t *ev) {
+    push_i(ev->conn, ev->packet);
+    ev->packet = NULL;
+}
+
+/* Resend the I frame originally sent as N(S) ns */
+static void push_old_i_frame_on_queue(ax25_dl_event_t *ev, uint8_t ns) {
+    buffer_t *pkt = *conn_sent_slot(ev->conn, ns);
+    CHECK(pkt);
+    dl_xmit(ev, pkt);
 }
 
 static void set_state(connection_t *conn, conn_state_t state) {
-    conn->state = state;
+    conn->hot.state = state;
     if (state == STATE_DISCONNECTED) {
         if (conn->socket)
             socket_free(conn->socket);
@@ -452,74 +695,86 @@ static void set_state(connection_t *conn, conn_state_t state) {
 }
 
 static bool timer_running_t1(ax25_dl_event_t *ev) {
-    return (instant_cmp(ev->conn->t1_expiry, INSTANT_ZERO) != 0);
+    return timeout_running(&ev->conn->t1);
 }
 
 static void timer_start_t1(ax25_dl_event_t *ev) {
-    ev->conn->t1_expiry = instant_add(instant_now(), ev->conn->t1v);
+    timeout_start(&ev->conn->t1, instant_add(instant_now(), ev->conn->t1v));
 }
 
 static void timer_stop_t1(ax25_dl_event_t *ev) {
-    ev->conn->t1_remaining = instant_sub(ev->conn->t1_expiry, instant_now());
+    ev->conn->t1_remaining = instant_sub(ev->conn->t1.expiry, instant_now());
     if (duration_cmp(ev->conn->t1_remaining, DURATION_ZERO) < 0) {
         ev->conn->t1_remaining = DURATION_ZERO;
     }
-    ev->conn->t1_expiry = INSTANT_ZERO;
+    timeout_stop(&ev->conn->t1);
 }
 
 static bool timer_expired_t1(ax25_dl_event_t *ev) {
-    return instant_cmp(ev->conn->t1_expiry, instant_now()) > 0;
+    return instant_cmp(ev->conn->t1.expiry, instant_now()) > 0;
+}
+
+void dl_xmit_complete(uint8_t port, uint16_t id) {
+    connection_t *conn = conn_find_by_xmit_id(port, id);
+    if (!conn)
+        return; /* Not the latest frame on any connection */
+    conn_set_xmit_id(conn, 0);
+    /* Restart T1 from when the frame left the radio, so that neither T1 nor
+     * the SRTT estimate include time spent queued in the TNC. */
+    if (timeout_running(&conn->t1))
+        timeout_start(&conn->t1, instant_add(instant_now(), conn->t1v));
 }
 
 static void timer_start_t2(ax25_dl_event_t *ev) {
-    ev->conn->t2_expiry = instant_add(instant_now(), ev->conn->t2);
+    timeout_start(&ev->conn->t2, instant_add(instant_now(), ev->conn->t2v));
 }
 
 static void timer_stop_t2(ax25_dl_event_t *ev) {
-    ev->conn->t2_expiry = INSTANT_ZERO;
+    timeout_stop(&ev->conn->t2);
 }
 
 static void timer_start_t3(ax25_dl_event_t *ev) {
-    ev->conn->t3_expiry = instant_add(instant_now(), duration_minutes(T3_DURATION_MINUTES));
+    timeout_start(&ev->conn->t3, instant_add(instant_now(), duration_minutes(T3_DURATION_MINUTES)));
 }
 
 static void timer_stop_t3(ax25_dl_event_t *ev) {
-    ev->conn->t3_expiry = INSTANT_ZERO;
+    timeout_stop(&ev->conn->t3);
 }
 
 static void clear_exception_conditions(ax25_dl_event_t *ev) {
-    ev->conn->peer_busy = false;
-    ev->conn->rej_exception = false;
-    ev->conn->self_busy = false;
-    ev->conn->ack_pending = false;
+    ev->conn->hot.peer_busy = false;
+    ev->conn->hot.rej_exception = false;
+    ev->conn->hot.self_busy = false;
+    ev->conn->hot.pool_busy = false;
+    ev->conn->hot.ack_pending = false;
 }
 
 static void set_version_2_0(ax25_dl_event_t *ev) {
     ev->conn->version = AX_2_0;
-    ev->conn->srej_enabled = false;
-    ev->conn->modulo = 8;
+    ev->conn->hot.srej_enabled = false;
+    ev->conn->hot.modulo = 8;
     ev->conn->n1 = 2048;
-    ev->conn->window_size = 4;
-    ev->conn->t2 = duration_seconds(3);
+    conn_set_window(ev->conn, 4);
+    ev->conn->t2v = duration_seconds(3);
     ev->conn->n2 = 10;
 }
 
 static void set_version_2_2(ax25_dl_event_t *ev) {
     ev->conn->version = AX_2_2;
-    ev->conn->srej_enabled = true;
-    ev->conn->modulo = 128;
+    ev->conn->hot.srej_enabled = true;
+    ev->conn->hot.modulo = 128;
     ev->conn->n1 = 2048;
-    ev->conn->window_size = 32;
-    ev->conn->t2 = duration_seconds(3);
+    conn_set_window(ev->conn, MAX_WINDOW);
+    ev->conn->t2v = duration_seconds(3);
     ev->conn->n2 = 10;
 }
 
 
 static void establish_data_link(ax25_dl_event_t *ev) {
     clear_exception_conditions(ev);
-    ev->conn->rc = 1;
+    ev->conn->hot.rc = 1;
     ev->p = true;
-    if (ev->conn->modulo == 128) {
+    if (ev->conn->hot.modulo == 128) {
         set_version_2_2(ev);
         send_sabme(ev, ev->p);
     } else {
@@ -539,43 +794,38 @@ static void nr_error_recovery(ax25_dl_event_t *ev) {
 
 
 static void transmit_inquiry(ax25_dl_event_t *ev) {
-    ax25_dl_event_t tmpev = *ev;
-    tmpev.p = true;
-    tmpev.nr = ev->conn->rcv_state;
-    if (ev->conn->self_busy) {
-        send_rnr(&tmpev, TYPE_CMD, ev->f);
+    if (ev->conn->hot.self_busy) {
+        send_rnr(ev, TYPE_CMD, /* p= */ true);
     } else {
-        send_rr(&tmpev, TYPE_CMD, ev->f);
+        send_rr(ev, TYPE_CMD, /* p= */ true);
     }
-    ev->conn->ack_pending = false;
+    ev->conn->hot.ack_pending = false;
     timer_start_t1(ev);
     timer_stop_t2(ev);
 }
 
 static void enquiry_response(ax25_dl_event_t *ev, bool f) {
-    ax25_dl_event_t tmp_ev = *ev;
-    tmp_ev.nr = ev->conn->rcv_state;
-    if (ev->conn->self_busy) {
-        send_rnr(&tmp_ev, TYPE_RES, f);
+    if (ev->conn->hot.self_busy) {
+        send_rnr(ev, TYPE_RES, f);
     } else {
-        send_rr(&tmp_ev, TYPE_RES, f);
+        send_rr(ev, TYPE_RES, f);
     }
-    ev->conn->ack_pending = false;
+    ev->conn->hot.ack_pending = false;
     timer_stop_t2(ev);
 }
 
-static void invoke_retransmission(ax25_dl_event_t *ev) {
+static inline void invoke_retransmission(ax25_dl_event_t *ev, const uint8_t modulo) {
     /* backtrack */
-    uint8_t x = ev->conn->snd_state;
-    ev->conn->snd_state = ev->nr;
-    do {
-        push_old_i_frame_nr_on_queue(ev);
-        ev->conn->snd_state += 1;
-    } while (ev->conn->snd_state != x);
+    uint8_t x = ev->conn->hot.snd_state;
+    ev->conn->hot.snd_state = ev->nr;
+    while (ev->conn->hot.snd_state != x) {
+        push_old_i_frame_on_queue(ev, ev->conn->hot.snd_state);
+        ev->conn->hot.snd_state = (ev->conn->hot.snd_state + 1) % modulo;
+    }
 }
 
 static void select_t1(ax25_dl_event_t *ev) {
-    if (ev->conn->rc == 0) {
+    if (ev->conn->hot.rc == 0) {
         duration_t srtt = duration_mul(ev->conn->srtt, 7);
         srtt = duration_add(srtt, ev->conn->t1v);
         srtt = duration_sub(srtt, ev->conn->t1_remaining);
@@ -583,24 +833,36 @@ static void select_t1(ax25_dl_event_t *ev) {
         ev->conn->srtt = srtt;
         ev->conn->t1v = duration_mul(ev->conn->srtt, 2);
     } else if (timer_expired_t1(ev)) {
-          ev->conn->t1v = duration_mul(ev->conn->srtt, (1 << (ev->conn->rc+1)));
+          ev->conn->t1v = duration_mul(ev->conn->srtt, (1 << (ev->conn->hot.rc+1)));
     }
 }
 
-static void check_i_frame_acked(ax25_dl_event_t *ev) {
-    if (ev->conn->peer_busy) {
-        ev->conn->ack_state = ev->nr;
+/* V(A) := N(R).  The frames it acknowledges will never be sent again, so
+ * their buffers go back to the pool now rather than when the slot is reused.
+ */
+static inline void set_ack_state(ax25_dl_event_t *ev, const uint8_t modulo) {
+    for(uint8_t seqno = ev->conn->hot.ack_state; seqno != ev->nr; seqno = (seqno + 1) % modulo) {
+        buffer_t **slot = conn_sent_slot(ev->conn, seqno);
+        if (*slot)
+            buffer_free(slot);
+    }
+    ev->conn->hot.ack_state = ev->nr;
+}
+
+static inline void check_i_frame_acked(ax25_dl_event_t *ev, const uint8_t modulo) {
+    if (ev->conn->hot.peer_busy) {
+        set_ack_state(ev, modulo);
         if (!timer_running_t1(ev)) {
             timer_start_t1(ev);
         }
-    } else if (ev->nr == ev->conn->snd_state) {
-        ev->conn->ack_state = ev->nr;
+    } else if (ev->nr == ev->conn->hot.snd_state) {
+        set_ack_state(ev, modulo);
         timer_stop_t1(ev);
         timer_stop_t2(ev);
         timer_stop_t3(ev);
         select_t1(ev);
-    } else if (ev->nr != ev->conn->ack_state) {
-        ev->conn->ack_state = ev->nr;
+    } else if (ev->nr != ev->conn->hot.ack_state) {
+        set_ack_state(ev, modulo);
         timer_start_t1(ev);
     }
 }
@@ -725,10 +987,12 @@ static void ax25_dl_disconnected(ax25_dl_event_t *ev) {
             if (!ev->conn) {
                 send_dm(ev, ev->f, /* expedited= */ false);
             } else {
+                /* Reply via the path the SABM came in on */
+                conn_set_path(ev->conn, &ev->address[ADDR_DIGI1], ev->address_count - ADDR_DIGI1);
                 send_ua(ev, false);
-                ev->conn->snd_state = 0;
-                ev->conn->ack_state = 0;
-                ev->conn->rcv_state = 0;
+                ev->conn->hot.snd_state = 0;
+                ev->conn->hot.ack_state = 0;
+                ev->conn->hot.rcv_state = 0;
 
                 dl_socket_t *sock = socket_allocate(ev->conn, DL_SOCK_CONNECTED, &ev->address[ADDR_DST]);
                 sock->on_connect = ev->socket->on_connect;
@@ -787,8 +1051,7 @@ static void ax25_dl_awaiting_connection(ax25_dl_event_t *ev) {
             break;
         case EV_DL_DATA:
             if (!ev->conn->l3_initiated) {
-                buffer_t *buf = buffer_allocate(ev->info, ev->info_len);
-                push_i(ev->conn, buf);
+                queue_dl_data(ev);
             }
             break;
 
@@ -858,7 +1121,7 @@ static void ax25_dl_awaiting_connection(ax25_dl_event_t *ev) {
             if (ev->conn->l3_initiated) {
                 send_connect_indication = true;
             } else {
-                if (ev->conn->snd_state != ev->conn->ack_state) {
+                if (ev->conn->hot.snd_state != ev->conn->hot.ack_state) {
                     discard_queue(ev->conn);
                     send_connect_indication = true;
                 }
@@ -866,7 +1129,7 @@ static void ax25_dl_awaiting_connection(ax25_dl_event_t *ev) {
             timer_stop_t1(ev);
             timer_stop_t2(ev);
             timer_start_t3(ev);
-            ev->conn->snd_state = ev->conn->ack_state = ev->conn->rcv_state = 0;
+            ev->conn->hot.snd_state = ev->conn->hot.ack_state = ev->conn->hot.rcv_state = 0;
             select_t1(ev);
             set_state(ev->conn, STATE_CONNECTED);
             if (send_connect_indication)
@@ -874,13 +1137,13 @@ static void ax25_dl_awaiting_connection(ax25_dl_event_t *ev) {
             break;
 
          case EV_TIMER_EXPIRE_T1:
-            if (ev->conn->rc == ev->conn->n2) {
+            if (ev->conn->hot.rc == ev->conn->n2) {
                 discard_queue(ev->conn);
                 dl_error(ev, ERR_G);
                 dl_disconnect_indication(ev);
                 set_state(ev->conn, STATE_DISCONNECTED);
             } else {
-                ev->conn->rc = ev->conn->rc + 1;
+                ev->conn->hot.rc = ev->conn->hot.rc + 1;
                 send_sabm(ev, /* p=*/ true);
                 select_t1(ev);
                 timer_start_t1(ev);
@@ -983,12 +1246,12 @@ static void ax25_dl_awaiting_release(ax25_dl_event_t *ev) {
             break;
 
         case EV_TIMER_EXPIRE_T1:
-            if (ev->conn->rc == ev->conn->n2) {
+            if (ev->conn->hot.rc == ev->conn->n2) {
                 dl_error(ev, ERR_H);
                 dl_disconnect_indication(ev);
                 set_state(ev->conn, STATE_DISCONNECTED);
             } else {
-                ev->conn->rc = ev->conn->rc + 1;
+                ev->conn->hot.rc = ev->conn->hot.rc + 1;
                 send_disc(ev, /* p= */ true);
                 select_t1(ev);
                 timer_start_t1(ev);
@@ -996,7 +1259,257 @@ static void ax25_dl_awaiting_release(ax25_dl_event_t *ev) {
     }
 }
 
+/* Ack V(R) within T2, unless something else acks it first */
+static void start_delayed_ack(ax25_dl_event_t *ev) {
+    if (!ev->conn->hot.ack_pending) {
+        ev->conn->hot.ack_pending = true;
+        timer_start_t2(ev);
+    }
+}
+
+/* State 3: Connected, I frame and supervisory handlers.
+ *
+ * Sending and receiving I frames, their acks and T1 are what a busy link
+ * spends its time on, so they get their own entries in dl_handlers rather
+ * than going through the big switch.  Anything touching sequence numbers is
+ * written once with the modulo as a parameter, and built for modulo 8 and
+ * modulo 128, so the sequence number arithmetic is a mask rather than a
+ * division.
+ */
+static inline void connected_drain_sendq(ax25_dl_event_t *ev, const uint8_t modulo) {
+    if (ev->conn->hot.peer_busy) {
+        /* Leave sendq buffer on queue */
+        return;
+    }
+    if (ev->conn->hot.snd_state == (ev->conn->hot.ack_state + ev->conn->hot.window_size) % modulo) {
+        /* Leave sendq buffer on queue */
+        CHECK(ev->conn->hot.window_size > 0);
+        return;
+    }
+
+    ev->ns = ev->conn->hot.snd_state;
+    ev->nr = ev->conn->hot.rcv_state;
+    ev->p = false;
+
+    /* The frame is built around the queued payload, and kept as is for
+     * retransmission */
+    buffer_t *pkt = pop_queue(ev->conn);
+    construct_i(ev, pkt, ev->nr);
+    dl_xmit(ev, pkt);
+    //DEBUG(STR("send I"));
+    buffer_t **slot = conn_sent_slot(ev->conn, ev->ns);
+    if (*slot) {
+        buffer_free(slot);
+    }
+    *slot = pkt;
+
+    ev->conn->hot.snd_state = (ev->conn->hot.snd_state + 1) % modulo;
+    ev->conn->hot.ack_pending = false;
+    timer_stop_t2(ev);
+    if (!timer_running_t1(ev)) {
+        timer_stop_t3(ev);
+        timer_start_t1(ev);
+    }
+}
+
+static inline void connected_rr(ax25_dl_event_t *ev, const uint8_t modulo) {
+    ev->conn->hot.peer_busy = false;
+    check_need_for_response(ev);
+    if (seqno_in_range_incl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        check_i_frame_acked(ev, modulo);
+    } else {
+        nr_error_recovery(ev);
+        if (ev->conn->version == AX_2_2)
+            set_state(ev->conn, STATE_AWAITING_CONNECT_2_2);
+        else
+            set_state(ev->conn, STATE_AWAITING_CONNECTION);
+    }
+}
+
+static inline void connected_rnr(ax25_dl_event_t *ev, const uint8_t modulo) {
+    ev->conn->hot.peer_busy = true;
+    check_need_for_response(ev);
+    if (seqno_in_range_incl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        check_i_frame_acked(ev, modulo);
+    } else {
+        nr_error_recovery(ev);
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+    }
+}
+
+static inline void connected_rej(ax25_dl_event_t *ev, const uint8_t modulo) {
+    ev->conn->hot.peer_busy = false;
+    check_need_for_response(ev);
+    if (seqno_in_range_excl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        set_ack_state(ev, modulo);
+        timer_stop_t1(ev);
+        timer_stop_t3(ev);
+        select_t1(ev);
+        invoke_retransmission(ev, modulo);
+    } else {
+        nr_error_recovery(ev);
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+    }
+}
+
+static void connected_t1(ax25_dl_event_t *ev) {
+    ev->conn->hot.rc = 1;
+    transmit_inquiry(ev);
+    set_state(ev->conn, STATE_TIMER_RECOVERY);
+}
+
+static inline void connected_i(ax25_dl_event_t *ev, const uint8_t modulo) {
+    if (ev->type != TYPE_CMD) {
+        dl_error(ev, ERR_S);
+        return;
+    }
+
+    if (ev->info_len >= ev->conn->n1) {
+        dl_error(ev, ERR_O); /* I frame exceeded maximum allowed length. */
+        establish_data_link(ev);
+        ev->conn->l3_initiated = false;
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+        return;
+    }
+
+    if (!seqno_in_range_incl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        /* received ack out of window */
+        nr_error_recovery(ev);
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+        return;
+    }
+
+    check_i_frame_acked(ev, modulo);
+
+    if (ev->conn->hot.self_busy) {
+        /* discard contents of i frame */
+        if (ev->p) {
+            ev->f = 1;
+            ev->nr = ev->conn->hot.rcv_state;
+            send_rnr(ev, TYPE_RES, ev->f);
+            ev->conn->hot.ack_pending = false;
+            timer_stop_t2(ev);
+        }
+        return;
+    }
+
+    if (ev->ns == ev->conn->hot.rcv_state) {
+        /* Happy path: We just received a frame that was in sequence */
+        ev->conn->hot.rcv_state = (ev->conn->hot.rcv_state + 1) % modulo;
+        ev->conn->hot.rej_exception = false;
+        if (ev->conn->hot.srej_exception > 0)
+            ev->conn->hot.srej_exception--;
+
+        /* Start the delayed ack before passing the data up, so that an I
+         * frame sent in reply carries the ack instead */
+        if (!ev->p)
+            start_delayed_ack(ev);
+
+        buffer_t *buf;
+        dl_data_indication(ev, ev->info, ev->info_len);
+        while ((buf = *conn_srej_slot(ev->conn, ev->conn->hot.rcv_state))) {
+            *conn_srej_slot(ev->conn, ev->conn->hot.rcv_state) = NULL;
+
+            dl_data_indication(ev, buf->buffer, buf->len);
+            buffer_free(&buf);
+            ev->conn->hot.rcv_state = (ev->conn->hot.rcv_state + 1) % modulo;
+            if (!ev->p)
+                start_delayed_ack(ev);
+        }
+
+        if (ev->p) {
+            ev->f = true;
+            send_rr(ev, TYPE_RES, ev->f);
+            ev->conn->hot.ack_pending = false;
+            timer_stop_t2(ev);
+        }
+        return;
+    }
+
+    if (ev->conn->hot.rej_exception) {
+        /* discard contents of I frame */
+        if (ev->p) {
+            ev->f = true;
+            send_rr(ev, TYPE_RES, ev->f);
+            ev->conn->hot.ack_pending = false;
+            timer_stop_t2(ev);
+        }
+        return;
+    }
+
+    if (!ev->conn->hot.srej_enabled) {
+        /* REJ frame */
+        /* discard contents of I frame */
+        ev->conn->hot.rej_exception = true;
+        ev->f = ev->p;
+        send_rej(ev, TYPE_RES, ev->f);
+        ev->conn->hot.ack_pending = false;
+        timer_stop_t2(ev);
+        return;
+    }
+
+    /* SREJ support */
+    if ((uint8_t)(ev->ns - ev->conn->hot.rcv_state) % modulo <= ev->conn->hot.ring_mask) {
+        /* Hold on to it until the frames before it turn up */
+        buffer_t **slot = conn_srej_slot(ev->conn, ev->ns);
+        if (!*slot)
+            *slot = buffer_allocate(ev->info, ev->info_len);
+    }
+
+    if (ev->conn->hot.srej_exception > 0) {
+        ev->nr = ev->ns;
+        ev->f = false;
+        ev->conn->hot.srej_exception += 1;
+        send_srej(ev, TYPE_RES, ev->f);
+        ev->conn->hot.ack_pending = false;
+        timer_stop_t2(ev);
+        return;
+    }
+
+    if (ev->ns == (ev->conn->hot.rcv_state + 1) % modulo) {
+        ev->nr = ev->conn->hot.rcv_state;
+        ev->f = true;
+        ev->conn->hot.srej_exception += 1;
+        send_srej(ev, TYPE_RES, ev->f);
+    } else {
+        /* If there are two or more frames missing, give up and use REJ instead of SREJ (6.4.4.3) */
+        /* discard contents of i frame */
+        ev->conn->hot.rej_exception = true;
+        ev->f = ev->p;
+        send_rej(ev, TYPE_RES, ev->f);
+    }
+    ev->conn->hot.ack_pending = false;
+    timer_stop_t2(ev);
+}
+
+/* DL-DATA request in the connected state.
+ *
+ * If nothing is queued ahead of it, the frame is sent straight away (window,
+ * peer and TNC permitting) rather than waiting for the ticker to drain it.
+ */
+static inline void connected_dl_data(ax25_dl_event_t *ev, const uint8_t modulo) {
+    bool idle = !ev->conn->hot.send_queue_head;
+    queue_dl_data(ev);
+    if (idle && !kiss_xmit_congested(ev->conn->port))
+        connected_drain_sendq(ev, modulo);
+}
+
+static void connected_dl_data_mod8(ax25_dl_event_t *ev) { connected_dl_data(ev, 8); }
+static void connected_dl_data_mod128(ax25_dl_event_t *ev) { connected_dl_data(ev, 128); }
+static void connected_drain_sendq_mod8(ax25_dl_event_t *ev) { connected_drain_sendq(ev, 8); }
+static void connected_drain_sendq_mod128(ax25_dl_event_t *ev) { connected_drain_sendq(ev, 128); }
+static void connected_i_mod8(ax25_dl_event_t *ev) { connected_i(ev, 8); }
+static void connected_i_mod128(ax25_dl_event_t *ev) { connected_i(ev, 128); }
+static void connected_rr_mod8(ax25_dl_event_t *ev) { connected_rr(ev, 8); }
+static void connected_rr_mod128(ax25_dl_event_t *ev) { connected_rr(ev, 128); }
+static void connected_rnr_mod8(ax25_dl_event_t *ev) { connected_rnr(ev, 8); }
+static void connected_rnr_mod128(ax25_dl_event_t *ev) { connected_rnr(ev, 128); }
+static void connected_rej_mod8(ax25_dl_event_t *ev) { connected_rej(ev, 8); }
+static void connected_rej_mod128(ax25_dl_event_t *ev) { connected_rej(ev, 128); }
+
 /* State 3: Connected.
+ *
+ * I frames, RR, RNR, REJ, T1 and the send queue are handled above.
  */
 static void ax25_dl_connected(ax25_dl_event_t *ev) {
     CHECK(ev->conn);
@@ -1043,58 +1556,15 @@ static void ax25_dl_connected(ax25_dl_event_t *ev) {
 
         case EV_DL_DISCONNECT:
             discard_queue(ev->conn);
-            ev->conn->rc = 0;
+            ev->conn->hot.rc = 0;
             send_disc(ev, /* p= */ true);
             timer_stop_t3(ev);
             timer_start_t1(ev);
             set_state(ev->conn, STATE_AWAITING_RELEASE);
             break;
 
-        case EV_DL_DATA: {
-            buffer_t *buf = buffer_allocate(ev->info, ev->info_len);
-            push_i(ev->conn, buf);
-            break;
-         }
-
-        case EV_DRAIN_SENDQ:
-            if (ev->conn->peer_busy) {
-                /* Leave sendq buffer on queue */
-            } else if (ev->conn->snd_state == ev->conn->ack_state + ev->conn->window_size) {
-                /* Leave sendq buffer on queue */
-                CHECK(ev->conn->window_size > 0);
-            } else {
-                ev->ns = ev->conn->snd_state;
-                ev->nr = ev->conn->rcv_state;
-                ev->p = false;
-
-                buffer_t *buf = pop_queue(ev->conn);
-                packet_t *pkt = construct_i(ev, buf->buffer, buf->len, ev->nr);
-                kiss_xmit(ev->conn->port, pkt->buffer, pkt->len);
-                //DEBUG(STR("send I"));
-                buffer_free(&buf);
-                if (ev->conn->sent_buffer[ev->ns]) {
-                    packet_free(&ev->conn->sent_buffer[ev->ns]);
-                }
-                ev->conn->sent_buffer[ev->ns] = pkt;
-
-                ev->conn->snd_state = (ev->conn->snd_state + 1) % ev->conn->modulo;
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                if (timer_running_t1(ev)) {
-                    timer_stop_t3(ev);
-                    timer_start_t1(ev);
-                }
-            }
-            break;
-
-       case EV_TIMER_EXPIRE_T1:
-            ev->conn->rc = 1;
-            transmit_inquiry(ev);
-            set_state(ev->conn, STATE_TIMER_RECOVERY);
-            break;
-
        case EV_TIMER_EXPIRE_T3:
-            ev->conn->rc = 0;
+            ev->conn->hot.rc = 0;
             transmit_inquiry(ev);
             set_state(ev->conn, STATE_TIMER_RECOVERY);
             break;
@@ -1109,13 +1579,13 @@ static void ax25_dl_connected(ax25_dl_event_t *ev) {
             send_ua(ev, false);
             clear_exception_conditions(ev);
             dl_error(ev, ERR_F);
-            if (ev->conn->snd_state != ev->conn->ack_state) {
+            if (ev->conn->hot.snd_state != ev->conn->hot.ack_state) {
                 discard_queue(ev->conn);
                 dl_connect_indication(ev);
             }
             timer_stop_t1(ev);
             timer_start_t3(ev);
-            ev->conn->snd_state = ev->conn->ack_state = ev->conn->rcv_state = 0;
+            ev->conn->hot.snd_state = ev->conn->hot.ack_state = ev->conn->hot.rcv_state = 0;
             break;
 
        case EV_DISC:
@@ -1158,19 +1628,19 @@ static void ax25_dl_connected(ax25_dl_event_t *ev) {
             break;
 
        case EV_DL_FLOW_OFF:
-            if (!ev->conn->self_busy) {
-                ev->conn->self_busy = true;
-                send_rnr(ev, TYPE_CMD, /* f= */ false);
-                ev->conn->ack_pending = false;
+            if (!ev->conn->hot.self_busy) {
+                ev->conn->hot.self_busy = true;
+                send_rnr(ev, TYPE_CMD, /* p= */ false);
+                ev->conn->hot.ack_pending = false;
                 timer_stop_t2(ev);
             }
             break;
 
        case EV_DL_FLOW_ON:
-            if (ev->conn->self_busy) {
-                ev->conn->self_busy = false;
+            if (ev->conn->hot.self_busy) {
+                ev->conn->hot.self_busy = false;
                 send_rr(ev, TYPE_CMD, /* p= */ true);
-                ev->conn->ack_pending = false;
+                ev->conn->hot.ack_pending = false;
                 timer_stop_t2(ev);
                 if (!timer_running_t1(ev)) {
                     timer_stop_t3(ev);
@@ -1196,34 +1666,9 @@ static void ax25_dl_connected(ax25_dl_event_t *ev) {
             }
             break;
 
-       case EV_RR:
-            ev->conn->peer_busy = false;
-            check_need_for_response(ev);
-            if (seqno_in_range_incl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                check_i_frame_acked(ev);
-            } else {
-                nr_error_recovery(ev);
-                if (ev->conn->version == AX_2_2)
-                    set_state(ev->conn, STATE_AWAITING_CONNECT_2_2);
-                else
-                    set_state(ev->conn, STATE_AWAITING_CONNECTION);
-            }
-            break;
-
-       case EV_RNR:
-            ev->conn->peer_busy = true;
-            check_need_for_response(ev);
-            if (seqno_in_range_incl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                check_i_frame_acked(ev);
-            } else {
-                nr_error_recovery(ev);
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
-            }
-            break;
-
        case EV_TIMER_EXPIRE_T2:
-            if (ev->conn->ack_pending) {
-                ev->conn->ack_pending = false;
+            if (ev->conn->hot.ack_pending) {
+                ev->conn->hot.ack_pending = false;
                 timer_stop_t2(ev);
                 enquiry_response(ev, /* f= */ false);
             }
@@ -1231,159 +1676,210 @@ static void ax25_dl_connected(ax25_dl_event_t *ev) {
             break;
 
        case EV_SREJ:
-            ev->conn->peer_busy = false;
-            if (seqno_in_range_excl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
+            ev->conn->hot.peer_busy = false;
+            if (seqno_in_range_excl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
                 if (ev->type == TYPE_CMD ? ev->p : ev->f) {
-                    ev->conn->ack_state = ev->nr;
+                    set_ack_state(ev, ev->conn->hot.modulo);
                 }
                 timer_stop_t1(ev);
                 timer_start_t3(ev);
                 select_t1(ev);
-                push_old_i_frame_nr_on_queue(ev);
+                push_old_i_frame_on_queue(ev, ev->nr);
             } else {
                 nr_error_recovery(ev);
                 set_state(ev->conn, STATE_AWAITING_CONNECTION);
             }
             break;
+    }
+}
 
-        case EV_REJ:
-            ev->conn->peer_busy = false;
-            check_need_for_response(ev);
-            if (seqno_in_range_excl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                ev->conn->ack_state = ev->nr;
-                timer_stop_t1(ev);
-                timer_stop_t3(ev);
-                select_t1(ev);
-                invoke_retransmission(ev);
+/* State 4: Timer Recovery, I frame and supervisory handlers.
+ *
+ * As for state 3, these get their own entries in dl_handlers, built for
+ * modulo 8 and modulo 128.  The send queue drains the same way in both
+ * states, so that handler is shared.
+ */
+static inline void timer_recovery_rr(ax25_dl_event_t *ev, const uint8_t modulo) {
+    ev->conn->hot.peer_busy = ev->event == EV_RNR;
+
+    if (ev->type == TYPE_RES && ev->f) {
+        timer_stop_t1(ev);
+        select_t1(ev);
+        if (seqno_in_range_incl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+            set_ack_state(ev, modulo);
+            if (ev->conn->hot.snd_state == ev->conn->hot.rcv_state) {
+                timer_start_t3(ev);
+                set_state(ev->conn, STATE_CONNECTED);
             } else {
-                nr_error_recovery(ev);
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
+                invoke_retransmission(ev, modulo);
+                set_state(ev->conn, STATE_TIMER_RECOVERY);
             }
-            break;
+        } else {
+            nr_error_recovery(ev);
+            set_state(ev->conn, STATE_AWAITING_CONNECTION);
+        }
+        return;
+    }
 
-        case EV_I:
-            if (ev->type != TYPE_CMD) {
-                dl_error(ev, ERR_S);
-                break;
-            }
+    if (ev->type == TYPE_CMD && ev->p) {
+        enquiry_response(ev, true);
+    }
 
-            if (ev->info_len >= ev->conn->n1) {
-                dl_error(ev, ERR_O); /* I frame exceeded maximum allowed length. */
-                establish_data_link(ev);
-                ev->conn->l3_initiated = false;
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                break;
-            }
+    if (seqno_in_range_incl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        set_ack_state(ev, modulo);
+    } else {
+        nr_error_recovery(ev);
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+    }
+}
 
-            if (!seqno_in_range_incl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                /* received ack out of window */
-                nr_error_recovery(ev);
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                break;
-            }
+static inline void timer_recovery_rej(ax25_dl_event_t *ev, const uint8_t modulo) {
+    ev->conn->hot.peer_busy = false;
 
-            check_i_frame_acked(ev);
+    if (ev->type == TYPE_RES && ev->f) {
+        timer_stop_t1(ev);
+        select_t1(ev);
+    } else if (ev->type == TYPE_CMD && ev->p) {
+        enquiry_response(ev, ev->f);
+    }
 
-            if (ev->conn->self_busy) {
-                /* discard contents of i frame */
-                if (ev->p) {
-                    ev->f = 1;
-                    ev->nr = ev->conn->rcv_state;
-                    send_rnr(ev, TYPE_RES, ev->f);
-                    ev->conn->ack_pending = false;
-                    timer_stop_t2(ev);
-                }
-                break;
-            }
+    if (!seqno_in_range_excl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        nr_error_recovery(ev);
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+        return;
+    }
 
-            if (ev->ns == ev->conn->rcv_state) {
-                /* Happy path: We just received a frame that was in sequence */
-                ev->conn->rcv_state = (ev->conn->rcv_state + 1) % ev->conn->modulo;
-                ev->conn->rej_exception = false;
-                if (ev->conn->srej_exception > 0)
-                    ev->conn->srej_exception--;
-
-                buffer_t *buf;
-                dl_data_indication(ev, ev->info, ev->info_len);
-                while ((buf = ev->conn->srej_queue[ev->conn->rcv_state])) {
-                    ev->conn->srej_queue[ev->conn->rcv_state] = NULL;
-
-                    dl_data_indication(ev, buf->buffer, buf->len);
-                    buffer_free(&buf);
-                    ev->conn->rcv_state = (ev->conn->rcv_state + 1) % (ev->conn->modulo);
-                }
+    if (ev->conn->hot.snd_state != ev->conn->hot.ack_state) {
+        invoke_retransmission(ev, modulo);
+        set_state(ev->conn, STATE_TIMER_RECOVERY);
+        return;
+    }
 
-                if (ev->p) {
-                    ev->f = true;
-                    send_rr(ev, TYPE_RES, ev->f);
-                    ev->conn->ack_pending = false;
-                    timer_stop_t2(ev);
-                } else if (!ev->conn->ack_pending) {
-                    timer_start_t2(ev);
-                    ev->conn->ack_pending = true;
-                    timer_start_t2(ev);
-                }
-                break;
-            }
+    if (ev->type == TYPE_RES && ev->f) {
+        timer_start_t3(ev);
+        set_state(ev->conn, STATE_CONNECTED);
+    } else {
+        set_state(ev->conn, STATE_TIMER_RECOVERY);
+    }
+}
 
-            if (ev->conn->rej_exception) {
-                /* discard contents of I frame */
-                if (ev->p) {
-                    ev->f = true;
-                    send_rr(ev, TYPE_RES, ev->f);
-                    ev->conn->ack_pending = false;
-                    timer_stop_t2(ev);
-                }
-                break;
-            }
+static inline void timer_recovery_i(ax25_dl_event_t *ev, const uint8_t modulo) {
+    if (ev->type != TYPE_CMD) {
+        dl_error(ev, ERR_S);
+        return;
+    }
 
-            if (!ev->conn->srej_enabled) {
-                /* REJ frame */
-                /* discard contents of I frame */
-                ev->conn->rej_exception = true;
-                ev->f = ev->p;
-                send_rej(ev, TYPE_RES);
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                break;
-            }
+    if (ev->info_len >= ev->conn->n1) {
+        dl_error(ev, ERR_O);
+        establish_data_link(ev);
+        ev->conn->l3_initiated = false;
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+        return;
+    }
 
-            /* SREJ support */
-            ev->conn->srej_queue[ev->nr] = buffer_allocate(ev->info, ev->info_len);
+    if (!seqno_in_range_excl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
+        /* recieved ack out of window */
+        nr_error_recovery(ev);
+        set_state(ev->conn, STATE_AWAITING_CONNECTION);
+        return;
+    }
 
-            if (ev->conn->srej_exception > 0) {
-                ev->nr = ev->ns;
-                ev->f = false;
-                ev->conn->srej_exception += 1;
-                send_srej(ev, TYPE_RES);
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                break;
-            }
+    set_ack_state(ev, modulo);
 
-            if (ev->ns == (ev->conn->rcv_state + 1) % (ev->conn->modulo)) {
-                ev->nr = ev->conn->rcv_state;
-                ev->f = true;
-                ev->conn->srej_exception += 1;
-                send_srej(ev, TYPE_RES);
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                break;
-            } else {
-                /* If there are two or more frames missing, give up and use REJ instead of SREJ (6.4.4.3) */
-                /* discard contents of i frame */
-                ev->conn->rej_exception = true;
-                ev->f = ev->p;
-                send_rej(ev, TYPE_RES);
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                break;
-            }
+    if (ev->conn->hot.self_busy) {
+        /* discard contents of i frame */
+        if (ev->p) {
+            ev->f = 1;
+            ev->nr = ev->conn->hot.rcv_state;
+            send_rnr(ev, TYPE_RES, ev->f);
+            ev->conn->hot.ack_pending = false;
+            timer_stop_t2(ev);
+        }
+        return;
+    }
 
+    if (ev->ns == ev->conn->hot.rcv_state) {
+        /* Happy path: We just received a frame that was in sequence */
+        ev->conn->hot.rcv_state = (ev->conn->hot.rcv_state + 1) % modulo;
+        ev->conn->hot.rej_exception = false;
+        if (ev->conn->hot.srej_exception > 0)
+            ev->conn->hot.srej_exception--;
+
+        buffer_t *buf;
+        dl_data_indication(ev, ev->info, ev->info_len);
+        while ((buf = *conn_srej_slot(ev->conn, ev->conn->hot.rcv_state))) {
+            *conn_srej_slot(ev->conn, ev->conn->hot.rcv_state) = NULL;
+
+            dl_data_indication(ev, buf->buffer, buf->len);
+            buffer_free(&buf);
+            ev->conn->hot.rcv_state = (ev->conn->hot.rcv_state + 1) % modulo;
+        }
+
+        if (ev->p) {
+            ev->f = true;
+            send_rr(ev, TYPE_RES, ev->f);
+            ev->conn->hot.ack_pending = false;
+            timer_stop_t2(ev);
+        } else {
+            start_delayed_ack(ev);
+        }
+        return;
+    }
+
+    if (ev->ns == (ev->conn->hot.rcv_state + 1) % modulo) {
+        ev->nr = ev->conn->hot.rcv_state;
+        ev->f = true;
+        ev->conn->hot.srej_exception += 1;
+        send_srej(ev, TYPE_RES, ev->f);
+    } else {
+        /* If there are two or more frames missing, give up and use REJ instead of SREJ (6.4.4.3) */
+        /* discard contents of i frame */
+        ev->conn->hot.rej_exception = true;
+        ev->f = ev->p;
+        send_rej(ev, TYPE_RES, ev->f);
+    }
+    ev->conn->hot.ack_pending = false;
+    timer_stop_t2(ev);
+}
+
+static void timer_recovery_t1(ax25_dl_event_t *ev) {
+    if (ev->conn->hot.rc != ev->conn->n2) {
+        ev->conn->hot.rc = ev->conn->hot.rc + 1;
+        transmit_inquiry(ev);
+        return;
+    }
+
+    if (ev->conn->hot.ack_state == ev->conn->hot.snd_state) {
+        if (ev->conn->hot.peer_busy) {
+            dl_error(ev, ERR_T);
+        } else {
+            dl_error(ev, ERR_U);
+        }
+    } else {
+        dl_error(ev, ERR_I);
     }
+
+    /* dl_disconnect_request */
+
+    discard_queue(ev->conn);
+
+    send_dm(ev, ev->f, false);
+
+    timer_stop_t1(ev); // Missing from SDL
+    timer_stop_t3(ev); // Missing from SDL
+    set_state(ev->conn, STATE_DISCONNECTED);
 }
 
+static void timer_recovery_rr_mod8(ax25_dl_event_t *ev) { timer_recovery_rr(ev, 8); }
+static void timer_recovery_rr_mod128(ax25_dl_event_t *ev) { timer_recovery_rr(ev, 128); }
+static void timer_recovery_rej_mod8(ax25_dl_event_t *ev) { timer_recovery_rej(ev, 8); }
+static void timer_recovery_rej_mod128(ax25_dl_event_t *ev) { timer_recovery_rej(ev, 128); }
+static void timer_recovery_i_mod8(ax25_dl_event_t *ev) { timer_recovery_i(ev, 8); }
+static void timer_recovery_i_mod128(ax25_dl_event_t *ev) { timer_recovery_i(ev, 128); }
+
 /* State 4: Timer Recovery
+ *
+ * I frames, RR, RNR, REJ, T1 and the send queue are handled above.
  */
 static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
     switch (ev->event) {
@@ -1420,80 +1916,13 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
 
         case EV_DL_DISCONNECT:
             discard_queue(ev->conn);
-            ev->conn->rc = 0;
+            ev->conn->hot.rc = 0;
             send_disc(ev, /* p= */ true);
             timer_stop_t3(ev);
             timer_start_t1(ev);
             set_state(ev->conn, STATE_AWAITING_RELEASE);
             break;
 
-        case EV_DL_DATA: {
-            buffer_t *buf = buffer_allocate(ev->info, ev->info_len);
-            push_i(ev->conn, buf);
-            break;
-         }
-
-        case EV_DRAIN_SENDQ:
-            if (ev->conn->peer_busy || ev->conn->snd_state == ev->conn->ack_state + ev->conn->window_size) {
-                /* Don't dequeue packet */
-                break;
-            }
-
-            ev->ns = ev->conn->snd_state;
-            ev->nr = ev->conn->rcv_state;
-            ev->p = false;
-
-            buffer_t *buf = pop_queue(ev->conn);
-            packet_t *pkt = construct_i(ev, buf->buffer, buf->len, ev->nr);
-            kiss_xmit(ev->conn->port, pkt->buffer, pkt->len);
-            buffer_free(&buf);
-            if (ev->conn->sent_buffer[ev->ns]) {
-                packet_free(&ev->conn->sent_buffer[ev->ns]);
-            }
-            ev->conn->sent_buffer[ev->ns] = pkt;
-
-
-            ev->conn->ack_pending = false;
-            timer_stop_t2(ev);
-            ev->conn->snd_state += 1;
-
-            if (!timer_running_t1(ev)) {
-                timer_stop_t3(ev);
-                timer_start_t1(ev);
-            }
-
-            break;
-
-        case EV_TIMER_EXPIRE_T1:
-            if (ev->conn->rc != ev->conn->n2) {
-                ev->conn->rc = ev->conn->rc + 1;
-
-                transmit_inquiry(ev);
-
-                break;
-            }
-
-            if (ev->conn->ack_state == ev->conn->snd_state) {
-                if (ev->conn->peer_busy) {
-                    dl_error(ev, ERR_T);
-                } else {
-                    dl_error(ev, ERR_U);
-                }
-            } else {
-                dl_error(ev, ERR_I);
-            }
-
-            /* dl_disconnect_request */
-
-            discard_queue(ev->conn);
-
-            send_dm(ev, ev->f, false);
-
-            timer_stop_t1(ev); // Missing from SDL
-            timer_stop_t3(ev); // Missing from SDL
-            set_state(ev->conn, STATE_DISCONNECTED);
-            break;
-
        case EV_SABM:
        case EV_SABME:
             if (ev->event == EV_SABME) {
@@ -1509,7 +1938,7 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
 
             dl_error(ev, ERR_F);
 
-            if (ev->conn->snd_state != ev->conn->ack_state) {
+            if (ev->conn->hot.snd_state != ev->conn->hot.ack_state) {
                 discard_queue(ev->conn);
                 dl_connect_indication(ev);
             }
@@ -1517,52 +1946,11 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
             timer_stop_t1(ev);
             timer_start_t3(ev);
 
-            ev->conn->snd_state = ev->conn->ack_state = ev->conn->rcv_state = 0;
+            ev->conn->hot.snd_state = ev->conn->hot.ack_state = ev->conn->hot.rcv_state = 0;
 
             set_state(ev->conn, STATE_CONNECTED);
             break;
 
-       case EV_RR:
-       case EV_RNR:
-
-            if (ev->event == EV_RR) {
-                ev->conn->peer_busy = false;
-            } else {
-                ev->conn->peer_busy = true;
-            }
-
-            if (ev->type == TYPE_RES && ev->f) {
-                timer_stop_t1(ev);
-                select_t1(ev);
-                if (seqno_in_range_incl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                    ev->conn->ack_state = ev->nr;
-                    if (ev->conn->snd_state == ev->conn->rcv_state) {
-                        timer_start_t3(ev);
-                        set_state(ev->conn, STATE_CONNECTED);
-                    } else {
-                        invoke_retransmission(ev);
-                        set_state(ev->conn, STATE_TIMER_RECOVERY);
-                    }
-                } else {
-                    nr_error_recovery(ev);
-                    set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                }
-                break;
-            } else {
-                if (ev->type == TYPE_CMD && ev->p) {
-                    enquiry_response(ev, true);
-                }
-
-                if (seqno_in_range_incl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                    ev->conn->ack_state = ev->nr;
-                    break;
-                } else {
-                    nr_error_recovery(ev);
-                    set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                    break;
-                }
-            }
-
        case EV_DISC:
             discard_queue(ev->conn);
             ev->f = ev->p;
@@ -1588,8 +1976,8 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
             break;
 
         case EV_TIMER_EXPIRE_T2:
-            if (ev->conn->ack_pending) {
-                ev->conn->ack_pending = false;
+            if (ev->conn->hot.ack_pending) {
+                ev->conn->hot.ack_pending = false;
                 enquiry_response(ev, false);
             }
             timer_stop_t2(ev);
@@ -1612,37 +2000,6 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
             send_ui(ev, TYPE_CMD);
             break;
 
-        case EV_REJ:
-            ev->conn->peer_busy = false;
-
-            if (ev->type == TYPE_RES && ev->f) {
-                timer_stop_t1(ev);
-                select_t1(ev);
-            } else if (ev->type == TYPE_CMD && ev->p) {
-                enquiry_response(ev, ev->f);
-            }
-
-            if (!seqno_in_range_excl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                nr_error_recovery(ev);
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                break;
-            }
-
-            if (ev->conn->snd_state != ev->conn->ack_state) {
-                invoke_retransmission(ev);
-                set_state(ev->conn, STATE_TIMER_RECOVERY);
-                break;
-            }
-
-            if (ev->type == TYPE_RES && ev->f) {
-                timer_start_t3(ev);
-                set_state(ev->conn, STATE_CONNECTED);
-                break;
-            } else {
-                set_state(ev->conn, STATE_TIMER_RECOVERY);
-                break;
-            }
-
        case EV_DM:
             dl_error(ev, ERR_E);
 
@@ -1657,24 +2014,24 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
             break;
 
        case EV_DL_FLOW_OFF:
-            if (!ev->conn->self_busy) {
-                ev->conn->self_busy = true;
+            if (!ev->conn->hot.self_busy) {
+                ev->conn->hot.self_busy = true;
 
-                send_rnr(ev, TYPE_CMD, false);
+                send_rnr(ev, TYPE_CMD, /* p= */ false);
 
-                ev->conn->ack_pending = false;
+                ev->conn->hot.ack_pending = false;
                 timer_stop_t2(ev);
             }
 
             break;
 
         case EV_DL_FLOW_ON:
-            if (ev->conn->self_busy) {
-                ev->conn->self_busy = false;
+            if (ev->conn->hot.self_busy) {
+                ev->conn->hot.self_busy = false;
 
-                send_rr(ev, TYPE_CMD, true);
+                send_rr(ev, TYPE_CMD, /* p= */ true);
 
-                ev->conn->ack_pending = false;
+                ev->conn->hot.ack_pending = false;
                 timer_stop_t2(ev);
 
                 if (!timer_running_t1(ev)) {
@@ -1695,25 +2052,25 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
             break;
 
         case EV_SREJ:
-            ev->conn->peer_busy = false;
+            ev->conn->hot.peer_busy = false;
 
             if (ev->type == TYPE_RES) {
                 timer_stop_t1(ev);
                 select_t1(ev);
             }
 
-            if (!seqno_in_range_excl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
+            if (!seqno_in_range_excl(ev->conn->hot.ack_state, ev->nr, ev->conn->hot.snd_state)) {
                 nr_error_recovery(ev);
                 set_state(ev->conn, STATE_AWAITING_CONNECTION);
                 break;
             }
 
             if ((ev->type == TYPE_RES && ev->f) || (ev->type == TYPE_CMD && ev->p)) {
-                ev->conn->ack_state = ev->nr;
+                set_ack_state(ev, ev->conn->hot.modulo);
             }
 
-            if (ev->conn->ack_state != ev->conn->snd_state) {
-                push_old_i_frame_nr_on_queue(ev);
+            if (ev->conn->hot.ack_state != ev->conn->hot.snd_state) {
+                push_old_i_frame_on_queue(ev, ev->nr);
                 break;
             }
 
@@ -1723,89 +2080,6 @@ static void ax25_dl_timer_recovery(ax25_dl_event_t *ev) {
                 break;
             }
             break;
-
-       case EV_I:
-            if (ev->type != TYPE_CMD) {
-                dl_error(ev, ERR_S);
-                break;
-            }
-
-            if (ev->info_len >= ev->conn->n1) {
-                dl_error(ev, ERR_O);
-                establish_data_link(ev);
-                ev->conn->l3_initiated = false;
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                break;
-            }
-
-            if (!seqno_in_range_excl(ev->conn->ack_state, ev->nr, ev->conn->snd_state)) {
-                /* recieved ack out of window */
-                nr_error_recovery(ev);
-                set_state(ev->conn, STATE_AWAITING_CONNECTION);
-                break;
-            }
-
-            ev->conn->ack_state = ev->nr;
-
-            if (ev->conn->self_busy) {
-                /* discard contents of i frame */
-                if (ev->p) {
-                    ev->f = 1;
-                    ev->nr = ev->conn->rcv_state;
-                    send_rnr(ev, TYPE_RES, ev->f);
-                    ev->conn->ack_pending = false;
-                    timer_stop_t2(ev);
-                }
-                break;
-            }
-
-            if (ev->ns == ev->conn->rcv_state) {
-                /* Happy path: We just received a frame that was in sequence */
-                ev->conn->rcv_state = (ev->conn->rcv_state + 1) % ev->conn->modulo;
-                ev->conn->rej_exception = false;
-                if (ev->conn->srej_exception > 0)
-                    ev->conn->srej_exception--;
-
-                buffer_t *buf;
-                dl_data_indication(ev, ev->info, ev->info_len);
-                while ((buf = ev->conn->srej_queue[ev->conn->rcv_state])) {
-                    ev->conn->srej_queue[ev->conn->rcv_state] = NULL;
-
-                    dl_data_indication(ev, buf->buffer, buf->len);
-                    buffer_free(&buf);
-                    ev->conn->rcv_state = (ev->conn->rcv_state + 1) % (ev->conn->modulo);
-                }
-
-                if (ev->p) {
-                    ev->f = true;
-                    send_rr(ev, TYPE_RES, ev->f);
-                    ev->conn->ack_pending = false;
-                    timer_stop_t2(ev);
-                } else if (!ev->conn->ack_pending) {
-                    timer_start_t2(ev);
-                    ev->conn->ack_pending = true;
-                }
-                break;
-            }
-
-            if (ev->ns == (ev->conn->rcv_state + 1) % (ev->conn->modulo)) {
-                ev->nr = ev->conn->rcv_state;
-                ev->f = true;
-                ev->conn->srej_exception += 1;
-                send_srej(ev, TYPE_RES);
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                break;
-            } else {
-                /* If there are two or more frames missing, give up and use REJ instead of SREJ (6.4.4.3) */
-                /* discard contents of i frame */
-                ev->conn->rej_exception = true;
-                ev->f = ev->p;
-                send_rej(ev, TYPE_RES);
-                ev->conn->ack_pending = false;
-                timer_stop_t2(ev);
-                break;
-            }
     }
 }
 
@@ -1829,8 +2103,7 @@ static void ax25_dl_awaiting_connection_2_2(ax25_dl_event_t *ev) {
 
         case EV_DL_DATA:
             if (!ev->conn->l3_initiated) {
-                buffer_t *buf = buffer_allocate(ev->info, ev->info_len);
-                push_i(ev->conn, buf);
+                queue_dl_data(ev);
             }
             break;
 
@@ -1894,7 +2167,7 @@ static void ax25_dl_awaiting_connection_2_2(ax25_dl_event_t *ev) {
             }
 
             if (!ev->conn->l3_initiated) {
-                if (ev->conn->snd_state != ev->conn->ack_state) {
+                if (ev->conn->hot.snd_state != ev->conn->hot.ack_state) {
                     ev->conn->srtt = default_srtt();
                     ev->conn->t1v = duration_mul(ev->conn->srtt, 2);
                 } else {
@@ -1907,9 +2180,9 @@ static void ax25_dl_awaiting_connection_2_2(ax25_dl_event_t *ev) {
             timer_stop_t1(ev);
             timer_start_t3(ev);
 
-            ev->conn->snd_state = 0;
-            ev->conn->ack_state = 0;
-            ev->conn->rcv_state = 0;
+            ev->conn->hot.snd_state = 0;
+            ev->conn->hot.ack_state = 0;
+            ev->conn->hot.rcv_state = 0;
 
             select_t1(ev);
 
@@ -1919,7 +2192,7 @@ static void ax25_dl_awaiting_connection_2_2(ax25_dl_event_t *ev) {
             break;
 
         case EV_TIMER_EXPIRE_T1:
-            if (ev->conn->rc == ev->conn->n2) {
+            if (ev->conn->hot.rc == ev->conn->n2) {
                 discard_queue(ev->conn);
                 dl_error(ev, ERR_G); /* (G is not defined): Connection timed out */
                 dl_disconnect_indication(ev);
@@ -1927,7 +2200,7 @@ static void ax25_dl_awaiting_connection_2_2(ax25_dl_event_t *ev) {
                 break;
             }
 
-            ev->conn->rc++;
+            ev->conn->hot.rc++;
 
             select_t1(ev);
 
@@ -2020,19 +2293,68 @@ static const char *ax25_dl_strevent(ax25_dl_event_type_t ev) {
     return ax25_dl_eventmsg[ev];
 }
 
+/* Whether conn could send some of its queue now, or is busy because buffers
+ * are low and needs checking on until they recover.
+ */
+static bool conn_wants_service(const connection_t *conn) {
+    if (conn->hot.pool_busy)
+        return true;
+    if (conn->hot.state != STATE_CONNECTED && conn->hot.state != STATE_TIMER_RECOVERY)
+        return false;
+    return conn->hot.send_queue_head
+        && !conn->hot.peer_busy
+        && conn->hot.snd_state != (conn->hot.ack_state + conn->hot.window_size) % conn->hot.modulo;
+}
+
+typedef void (*dl_handler_t)(ax25_dl_event_t *ev);
+
+/* Handlers for each state, for any event without its own handler below */
+static const dl_handler_t dl_state_handlers[STATE_COUNT] = {
+    [STATE_DISCONNECTED] = ax25_dl_disconnected,
+    [STATE_AWAITING_CONNECTION] = ax25_dl_awaiting_connection,
+    [STATE_AWAITING_RELEASE] = ax25_dl_awaiting_release,
+    [STATE_CONNECTED] = ax25_dl_connected,
+    [STATE_TIMER_RECOVERY] = ax25_dl_timer_recovery,
+    [STATE_AWAITING_CONNECT_2_2] = ax25_dl_awaiting_connection_2_2,
+};
+
+/* Handlers for (state, event) pairs, for modulo 8 and modulo 128 connections. */
+static const dl_handler_t dl_handlers[STATE_COUNT][EV_COUNT][2] = {
+    [STATE_CONNECTED] = {
+        [EV_I] = { connected_i_mod8, connected_i_mod128 },
+        [EV_RR] = { connected_rr_mod8, connected_rr_mod128 },
+        [EV_RNR] = { connected_rnr_mod8, connected_rnr_mod128 },
+        [EV_REJ] = { connected_rej_mod8, connected_rej_mod128 },
+        [EV_TIMER_EXPIRE_T1] = { connected_t1, connected_t1 },
+        [EV_DL_DATA] = { connected_dl_data_mod8, connected_dl_data_mod128 },
+        [EV_DRAIN_SENDQ] = { connected_drain_sendq_mod8, connected_drain_sendq_mod128 },
+    },
+    [STATE_TIMER_RECOVERY] = {
+        [EV_I] = { timer_recovery_i_mod8, timer_recovery_i_mod128 },
+        [EV_RR] = { timer_recovery_rr_mod8, timer_recovery_rr_mod128 },
+        [EV_RNR] = { timer_recovery_rr_mod8, timer_recovery_rr_mod128 },
+        [EV_REJ] = { timer_recovery_rej_mod8, timer_recovery_rej_mod128 },
+        [EV_TIMER_EXPIRE_T1] = { timer_recovery_t1, timer_recovery_t1 },
+        [EV_DL_DATA] = { queue_dl_data, queue_dl_data },
+        [EV_DRAIN_SENDQ] = { connected_drain_sendq_mod8, connected_drain_sendq_mod128 },
+    },
+};
+
 void ax25_dl_event(ax25_dl_event_t *ev) {
     //DEBUG(D8(conn_get_state(ev->conn)), STR(": "), STR(ax25_dl_strevent(ev->event)));
-    switch (conn_get_state(ev->conn)) {
-        case STATE_DISCONNECTED: ax25_dl_disconnected(ev); break;
-        case STATE_AWAITING_CONNECTION: ax25_dl_awaiting_connection(ev); break;
-        case STATE_AWAITING_RELEASE: ax25_dl_awaiting_release(ev); break;
-        case STATE_CONNECTED: ax25_dl_connected(ev); break;
-        case STATE_TIMER_RECOVERY: ax25_dl_timer_recovery(ev); break;
-        case STATE_AWAITING_CONNECT_2_2: ax25_dl_awaiting_connection_2_2(ev); break;
+    conn_state_t state = conn_get_state(ev->conn);
+    CHECK((size_t)state < STATE_COUNT && (size_t)ev->event < EV_COUNT);
+    dl_handler_t handler = dl_handlers[state][ev->event][conn_is_extended(ev->conn)];
+    if (handler)
+        handler(ev);
+    else
+        dl_state_handlers[state](ev);
+
+    if (ev->conn) {
+        CHECK(ev->conn->hot.state == STATE_CONNECTED || !timeout_running(&ev->conn->t3));
+        if (conn_wants_service(ev->conn))
+            conn_schedule(ev->conn);
     }
-
-    if (ev->conn)
-        CHECK(ev->conn->state == STATE_CONNECTED || instant_cmp(ev->conn->t3_expiry, INSTANT_ZERO) == 0);
 }
 
 static const char *ax25_dl_errmsg[] = {
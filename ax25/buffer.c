@@ -7,34 +7,188 @@
 #include "config.h"
 #include "metric.h"
 #include "debug.h"
+#include "platform.h"
 #include <string.h> // for memcpy
 
-/* TODO: Instead of always using the largest buffer size, we should have
- * multiple bufferpools, eg: one at 2048 bytes, one at 512 bytes, one at 128
- * bytes.  Try and allocate from the smallest buffer that will fit, otherwise
- * try the next largest etc.
+/* Buffers come from one of several pools of different sizes.  Allocations use
+ * the smallest size that will fit the contents and BUFFER_HEADROOM, otherwise
+ * the next largest etc.
+ *
+ * Each pool hands out buffers it has never used in order, and keeps freed
+ * buffers on a free list linked through buffer_t.next, so allocating and
+ * freeing never scan the pool.
+ *
+ * Once a pool is used up, platforms with platform_alloc() grow it by slabs of
+ * BUFFER_SLAB buffers, up to MAX_BUFFER_SLABS times, which go straight onto
+ * the free list.
  */
-static buffer_t bufferpool[MAX_BUFFERS] = { { .in_use = false }, };
+typedef struct buffer_class_t {
+    buffer_t *pool;
+    uint8_t *storage;
+    size_t count;
+    size_t size;
+    metric_t metric;
+    size_t unused; //< Index of the first buffer that's never been allocated
+    buffer_t *free;
+    size_t slabs; //< Slabs grown with platform_alloc()
+} buffer_class_t;
 
-buffer_t *buffer_allocate(const uint8_t *src, size_t len) {
+static buffer_t small_pool[MAX_SMALL_BUFFERS];
+static uint8_t small_storage[MAX_SMALL_BUFFERS][SMALL_BUFFER_SIZE];
+static buffer_t medium_pool[MAX_MEDIUM_BUFFERS];
+static uint8_t medium_storage[MAX_MEDIUM_BUFFERS][MEDIUM_BUFFER_SIZE];
+static buffer_t large_pool[MAX_LARGE_BUFFERS];
+static uint8_t large_storage[MAX_LARGE_BUFFERS][LARGE_BUFFER_SIZE];
+
+static size_t buffers_free = MAX_BUFFERS;
+static bool pool_low = false;
+
+/* Smallest first */
+static buffer_class_t buffer_classes[] = {
+    { small_pool, &small_storage[0][0], MAX_SMALL_BUFFERS, SMALL_BUFFER_SIZE, METRIC_BUFFER_SMALL_ALLOC, 0, NULL, 0 },
+    { medium_pool, &medium_storage[0][0], MAX_MEDIUM_BUFFERS, MEDIUM_BUFFER_SIZE, METRIC_BUFFER_MEDIUM_ALLOC, 0, NULL, 0 },
+    { large_pool, &large_storage[0][0], MAX_LARGE_BUFFERS, LARGE_BUFFER_SIZE, METRIC_BUFFER_LARGE_ALLOC, 0, NULL, 0 },
+};
+
+enum { BUFFER_CLASSES = sizeof(buffer_classes) / sizeof(buffer_classes[0]) };
+
+static bool buffer_class_grow(buffer_class_t *class) {
+    if (class->slabs >= MAX_BUFFER_SLABS)
+        return false;
+    buffer_t *pool = platform_alloc(BUFFER_SLAB * sizeof(*pool));
+    uint8_t *storage = platform_alloc(BUFFER_SLAB * class->size);
+    if (!pool || !storage) {
+        platform_free(pool);
+        platform_free(storage);
+        return false;
+    }
+    for(size_t i = 0; i < BUFFER_SLAB; ++i) {
+        pool[i].storage = &storage[i * class->size];
+        pool[i].size = class->size;
+        pool[i].next = class->free;
+        class->free = &pool[i];
+    }
+    buffers_free += BUFFER_SLAB;
+    class->slabs++;
+    return true;
+}
+
+static buffer_t *buffer_class_allocate(buffer_class_t *class) {
+    buffer_t *buf = class->free;
+    if (buf) {
+        class->free = buf->next;
+        return buf;
+    }
+    if (class->unused < class->count) {
+        buf = &class->pool[class->unused];
+        buf->storage = &class->storage[class->unused * class->size];
+        buf->size = class->size;
+        class->unused++;
+        return buf;
+    }
+    if (buffer_class_grow(class))
+        return buffer_class_allocate(class);
+    return NULL;
+}
+
+static buffer_class_t *buffer_class_of(const buffer_t *buf) {
+    for(size_t c = 0; c < BUFFER_CLASSES; ++c) {
+        if (buffer_classes[c].size == buf->size)
+            return &buffer_classes[c];
+    }
+    panic("buffer from unknown pool");
+}
+
+/* Allocate a buffer with room for len bytes after the headroom */
+static buffer_t *buffer_allocate_storage(size_t len) {
     CHECK(len < MAX_PACKET_SIZE);
-    for(int i=0; i < MAX_BUFFERS; ++i) {
-        if (!bufferpool[i].in_use) {
-            bufferpool[i].in_use = true;
-            bufferpool[i].len = len;
-            bufferpool[i].next = NULL;
-            memcpy(bufferpool[i].buffer, src, len);
-            metric_inc(METRIC_BUFFER_ALLOC_SUCCESS);
-            return &bufferpool[i];
+    bool spilled = false;
+    for(size_t c = 0; c < BUFFER_CLASSES; ++c) {
+        buffer_class_t *class = &buffer_classes[c];
+        if (BUFFER_HEADROOM + len > class->size)
+            continue;
+        buffer_t *buf = buffer_class_allocate(class);
+        if (!buf) {
+            spilled = true;
+            continue;
         }
+        CHECK(buf->refs == 0);
+        buf->refs = 1;
+        buffers_free--;
+        buf->buffer = &buf->storage[BUFFER_HEADROOM];
+        buf->len = 0;
+        buf->next = NULL;
+        metric_inc(METRIC_BUFFER_ALLOC_SUCCESS);
+        metric_inc(class->metric);
+        if (spilled)
+            metric_inc(METRIC_BUFFER_SPILL);
+        return buf;
     }
     metric_inc(METRIC_BUFFER_ALLOC_FAIL);
     return NULL;
 }
 
+buffer_t *buffer_allocate(const uint8_t *src, size_t len) {
+    buffer_t *buf = buffer_allocate_storage(len);
+    if (buf) {
+        memcpy(buf->buffer, src, len);
+        buf->len = len;
+    }
+    return buf;
+}
+
+buffer_t *buffer_allocate_with_size(size_t len) {
+    CHECK(len <= BUFFER_HEADROOM);
+    return buffer_allocate_storage(0);
+}
+
+buffer_t *buffer_ref(buffer_t *buffer) {
+    CHECK(buffer->refs > 0 && buffer->refs < UINT8_MAX);
+    buffer->refs++;
+    return buffer;
+}
+
 void buffer_free(buffer_t **buffer) {
-    metric_inc(METRIC_BUFFER_FREE);
-    (*buffer)->in_use = false;
-    (*buffer)->len = 0;
+    buffer_t *buf = *buffer;
+    CHECK(buf->refs > 0); /* Double free */
     (*buffer) = NULL;
+    if (--buf->refs > 0)
+        return;
+
+    metric_inc(METRIC_BUFFER_FREE);
+    buf->len = 0;
+    if (POOL_POISON) {
+        for(size_t i = 0; i < buf->size; ++i)
+            buf->storage[i] = POOL_POISON_BYTE;
+    }
+
+    buffer_class_t *class = buffer_class_of(buf);
+    buf->next = class->free;
+    class->free = buf;
+    buffers_free++;
+    if (pool_low && buffers_free >= BUFFER_HIGH_WATER) {
+        /* Let connections that went busy go again.  pool_low only clears
+         * once they look, so this keeps waking until then. */
+        platform_wakeup();
+    }
+}
+
+bool buffer_pool_low(void) {
+    if (buffers_free <= BUFFER_LOW_WATER) {
+        /* Grow rather than push back, where the platform can */
+        for(size_t c = 0; c < BUFFER_CLASSES; ++c)
+            buffer_class_grow(&buffer_classes[c]);
+    }
+    if (buffers_free <= BUFFER_LOW_WATER)
+        pool_low = true;
+    else if (buffers_free >= BUFFER_HIGH_WATER)
+        pool_low = false;
+    return pool_low;
+}
+
+uint8_t *buffer_prepend(buffer_t *buffer, size_t len) {
+    CHECK(len <= buffer_headroom(buffer));
+    buffer->buffer -= len;
+    buffer->len += len;
+    return buffer->buffer;
 }
@@ -6,10 +6,197 @@
 #include "connection.h"
 #include "config.h"
 #include "ax25_dl.h"
+#include "hash_index.h"
+#include "kiss.h"
 #include "metric.h"
 #include "platform.h"
+#include "timeout.h"
+#include <string.h> // for memcpy
 
-static connection_t conntbl[MAX_CONN] = { { .state = STATE_DISCONNECTED, }, };
+static connection_t conntbl[MAX_CONN] = { { .hot.state = STATE_DISCONNECTED, }, };
+
+/* Connections live in conntbl, then in slabs of CONN_SLAB grown with
+ * platform_alloc() once it's full.  Slabs are never freed, so connections
+ * never move.
+ */
+typedef struct conn_slab_t {
+    struct conn_slab_t *next;
+    connection_t *conns;
+    size_t count;
+} conn_slab_t;
+
+static conn_slab_t conn_slabs = { .next = NULL, .conns = conntbl, .count = MAX_CONN };
+static conn_slab_t *conn_slabs_tail = &conn_slabs;
+static size_t conn_count = MAX_CONN;
+
+/* Connections that are (or were, when they were pushed) STATE_DISCONNECTED,
+ * linked through next_free.  Entries that have since been put to use are
+ * dropped as they reach the top, see conn_find_free().
+ */
+static connection_t *conn_free = NULL;
+static bool conntbl_on_free_list = false;
+
+static void conn_push_free(connection_t *conn) {
+    if (conn->on_free_list)
+        return;
+    conn->on_free_list = true;
+    conn->next_free = conn_free;
+    conn_free = conn;
+}
+
+static void conn_push_free_slab(connection_t *conns, size_t count) {
+    /* Backwards, so they're handed out in order */
+    for(size_t i = count; i > 0; --i)
+        conn_push_free(&conns[i - 1]);
+}
+
+/* Rings for conn_sent_slot() and conn_srej_slot().
+ *
+ * Each link has a sent ring and a SREJ ring of the same size, allocated as
+ * one block of 2 * size pointers.  Sizes are powers of two up to MAX_WINDOW.
+ * Blocks are carved from ring_arena, then from slabs grown with
+ * platform_alloc(), and are never freed: released blocks go on a free list
+ * for their size, linked through their first slot.
+ */
+static buffer_t *ring_arena[MAX_CONN * 2 * MAX_WINDOW];
+static buffer_t **ring_slab = ring_arena;
+static size_t ring_slab_left = MAX_CONN * 2 * MAX_WINDOW;
+static buffer_t **ring_free[MAX_WINDOW + 1];
+
+static buffer_t **ring_allocate(size_t size) {
+    buffer_t **ring = ring_free[size];
+    if (ring) {
+        ring_free[size] = (buffer_t **)ring[0];
+    } else {
+        if (ring_slab_left < 2 * size) {
+            /* Whatever's left of the old slab is too small to bother with */
+            buffer_t **slab = platform_alloc(RING_SLAB * 2 * MAX_WINDOW * sizeof(*slab));
+            if (!slab)
+                return NULL;
+            ring_slab = slab;
+            ring_slab_left = RING_SLAB * 2 * MAX_WINDOW;
+        }
+        ring = ring_slab;
+        ring_slab += 2 * size;
+        ring_slab_left -= 2 * size;
+    }
+    for(size_t i = 0; i < 2 * size; ++i)
+        ring[i] = NULL;
+    return ring;
+}
+
+/* Free any frames left in conn's rings, and go back to the fallback rings */
+static void conn_ring_release(connection_t *conn) {
+    size_t size = conn->hot.ring_mask + 1;
+    buffer_t **ring = conn->hot.sent_buffer;
+    if (ring) {
+        for(size_t i = 0; i < 2 * size; ++i) {
+            if (ring[i])
+                buffer_free(&ring[i]);
+        }
+        if (ring != conn->ring_fallback) {
+            ring[0] = (buffer_t *)ring_free[size];
+            ring_free[size] = ring;
+        }
+    }
+    conn->hot.sent_buffer = &conn->ring_fallback[0];
+    conn->hot.srej_queue = &conn->ring_fallback[1];
+    conn->hot.ring_mask = 0;
+}
+
+void conn_set_window(connection_t *conn, uint8_t window_size) {
+    CHECK(window_size > 0 && window_size <= MAX_WINDOW);
+    conn_ring_release(conn);
+
+    size_t size = 1;
+    while (size < window_size)
+        size *= 2;
+    buffer_t **ring = NULL;
+    while (size > 1 && !(ring = ring_allocate(size)))
+        size /= 2;
+    if (ring) {
+        conn->hot.sent_buffer = ring;
+        conn->hot.srej_queue = ring + size;
+        conn->hot.ring_mask = size - 1;
+    }
+    if (window_size > size) {
+        metric_inc(METRIC_SMALL_WINDOW);
+        window_size = size;
+    }
+    conn->hot.window_size = window_size;
+}
+
+/* Hash index over every connection, keyed on (port, local, remote).
+ *
+ * Holds every connection handed out by conn_find_or_create() until it is
+ * released or its entry is reused, so it may include entries that are still
+ * STATE_DISCONNECTED.
+ */
+typedef struct conn_key_t {
+    uint8_t port;
+    const ssid_t *local;
+    const ssid_t *remote;
+} conn_key_t;
+
+static uint32_t conn_key_hash(uint8_t port, const ssid_t *local, const ssid_t *remote) {
+    return ssid_hash(ssid_hash(hash_byte(HASH_INIT, port), local), remote);
+}
+
+static uint32_t conn_hash(const void *entry) {
+    const connection_t *conn = entry;
+    return conn_key_hash(conn->port, &conn->local, &conn->remote);
+}
+
+static bool conn_match(const void *entry, const void *key) {
+    const connection_t *conn = entry;
+    const conn_key_t *k = key;
+    return conn->port == k->port
+        && ssid_cmp(&conn->local, k->local) == 0
+        && ssid_cmp(&conn->remote, k->remote) == 0;
+}
+
+static void *conn_index_slots[2 * MAX_CONN];
+static hash_index_t conn_index = {
+    .slots = conn_index_slots,
+    .size = 2 * MAX_CONN,
+    .hash = conn_hash,
+};
+
+static connection_t *conn_index_find(const ssid_t *local, const ssid_t *remote, uint8_t port) {
+    conn_key_t key = { .port = port, .local = local, .remote = remote };
+    return hash_index_find(&conn_index, conn_key_hash(port, local, remote), conn_match, &key);
+}
+
+/* Hash index over connections waiting for the TNC to acknowledge an ACKMODE
+ * frame, keyed on (port, xmit_id).  Only connections with a non-zero xmit_id
+ * are in it, see conn_set_xmit_id().
+ */
+typedef struct xmit_key_t {
+    uint8_t port;
+    uint16_t id;
+} xmit_key_t;
+
+static uint32_t xmit_key_hash(uint8_t port, uint16_t id) {
+    return hash_byte(hash_byte(hash_byte(HASH_INIT, port), id >> 8), id & 0xFF);
+}
+
+static uint32_t xmit_hash(const void *entry) {
+    const connection_t *conn = entry;
+    return xmit_key_hash(conn->port, conn->xmit_id);
+}
+
+static bool xmit_match(const void *entry, const void *key) {
+    const connection_t *conn = entry;
+    const xmit_key_t *k = key;
+    return conn->port == k->port && conn->xmit_id == k->id;
+}
+
+static void *xmit_index_slots[2 * MAX_CONN];
+static hash_index_t xmit_index = {
+    .slots = xmit_index_slots,
+    .size = 2 * MAX_CONN,
+    .hash = xmit_hash,
+};
 
 bool conn_is_extended(connection_t *conn) {
     if (!conn)
@@ -18,44 +205,156 @@ bool conn_is_extended(connection_t *conn) {
 }
 
 connection_t *conn_find(ssid_t *local, ssid_t *remote, uint8_t port) {
-    for(size_t i = 0; i < MAX_CONN; ++i) {
-        if (conntbl[i].state != STATE_DISCONNECTED
-                && conntbl[i].port == port
-                && ssid_cmp(&conntbl[i].local, local) == 0
-                && ssid_cmp(&conntbl[i].remote, remote) == 0)
-            return &conntbl[i];
-    }
+    connection_t *conn = conn_index_find(local, remote, port);
+    if (conn && conn->hot.state != STATE_DISCONNECTED)
+        return conn;
     return NULL;
 }
 
+connection_t *conn_find_by_xmit_id(uint8_t port, uint16_t id) {
+    if (id == 0)
+        return NULL;
+    xmit_key_t key = { .port = port, .id = id };
+    connection_t *conn = hash_index_find(&xmit_index, xmit_key_hash(port, id), xmit_match, &key);
+    if (conn && conn->hot.state != STATE_DISCONNECTED)
+        return conn;
+    return NULL;
+}
+
+void conn_set_xmit_id(connection_t *conn, uint16_t id) {
+    if (conn->xmit_id == id)
+        return;
+    if (conn->xmit_id != 0)
+        hash_index_remove(&xmit_index, conn);
+    conn->xmit_id = id;
+    if (id != 0)
+        hash_index_insert(&xmit_index, conn);
+}
+
+static void conn_expire(connection_t *conn, ax25_dl_event_type_t event) {
+    if (conn->hot.state == STATE_DISCONNECTED)
+        return;
+    ax25_dl_event_t ev;
+    ev.event = event;
+    ev.conn = conn;
+    ev.address_count = 0;
+    ax25_dl_event(&ev);
+}
+
+static void conn_expire_t1(timeout_t *timeout) {
+    connection_t *conn = timeout->userdata;
+    if (conn->xmit_id != 0) {
+        /* The frame T1 is timing is still queued in the TNC, so
+         * retransmitting it would only queue another copy behind
+         * it.  Give the TNC one more T1 to send it. */
+        conn_set_xmit_id(conn, 0);
+        timeout_start(&conn->t1, instant_add(instant_now(), conn->t1v));
+        return;
+    }
+    conn_expire(conn, EV_TIMER_EXPIRE_T1);
+}
+
+static void conn_expire_t2(timeout_t *timeout) {
+    conn_expire(timeout->userdata, EV_TIMER_EXPIRE_T2);
+}
+
+static void conn_expire_t3(timeout_t *timeout) {
+    conn_expire(timeout->userdata, EV_TIMER_EXPIRE_T3);
+}
+
+/* Move a connection index into slots for count connections */
+static bool conn_index_grow(hash_index_t *index, void **static_slots, size_t count) {
+    void **slots = platform_alloc(2 * count * sizeof(*slots));
+    if (!slots)
+        return false;
+    void **old_slots = index->slots;
+    hash_index_resize(index, slots, 2 * count);
+    if (old_slots != static_slots)
+        platform_free(old_slots);
+    return true;
+}
+
+/* Add a slab of connections, with room for them in the indexes and for their
+ * timers.  Returns false if there's no memory.
+ */
+static bool conn_grow(void) {
+    size_t count = conn_count + CONN_SLAB;
+    if (!timeout_reserve(3 * count)
+            || !conn_index_grow(&conn_index, conn_index_slots, count)
+            || !conn_index_grow(&xmit_index, xmit_index_slots, count))
+        return false;
+
+    conn_slab_t *slab = platform_alloc(sizeof(*slab));
+    connection_t *conns = platform_alloc(CONN_SLAB * sizeof(*conns));
+    if (!slab || !conns) {
+        platform_free(slab);
+        platform_free(conns);
+        return false;
+    }
+
+    /* platform_alloc() zeroes, so they all start out STATE_DISCONNECTED */
+    slab->conns = conns;
+    slab->count = CONN_SLAB;
+    conn_slabs_tail->next = slab;
+    conn_slabs_tail = slab;
+    conn_count = count;
+    conn_push_free_slab(conns, CONN_SLAB);
+    return true;
+}
+
+/* Return a STATE_DISCONNECTED connection.
+ *
+ * It stays on the free list until it's put to use, as callers may hand it
+ * back by just leaving it disconnected.
+ */
+static connection_t *conn_find_free(void) {
+    if (!conntbl_on_free_list) {
+        conn_push_free_slab(conntbl, MAX_CONN);
+        conntbl_on_free_list = true;
+    }
+    for (;;) {
+        while (conn_free && conn_free->hot.state != STATE_DISCONNECTED) {
+            conn_free->on_free_list = false;
+            conn_free = conn_free->next_free;
+        }
+        if (conn_free)
+            return conn_free;
+        if (!conn_grow())
+            return NULL;
+    }
+}
+
 connection_t *conn_find_or_create(ssid_t *local, ssid_t *remote, uint8_t port) {
-    connection_t *conn = NULL;
-    for(size_t i = 0; i < MAX_CONN; ++i) {
-        if (conntbl[i].state != STATE_DISCONNECTED) {
-            /* Is this in use by the address we are looking for? */
-            if (conntbl[i].port == port
-                    && ssid_cmp(&conntbl[i].local, local) == 0
-                    && ssid_cmp(&conntbl[i].remote, remote) == 0)
-                return &conntbl[i];
-        } else {
-            /* Remember we've found a free conntbl entry in case we need it */
-            conn = &conntbl[i];
+    connection_t *conn = conn_index_find(local, remote, port);
+    if (conn && conn->hot.state != STATE_DISCONNECTED)
+        return conn;
+    if (!conn) {
+        conn = conn_find_free();
+        if (conn) {
+            /* It may have been handed out before, but never used */
+            conn_set_xmit_id(conn, 0);
+            hash_index_remove(&conn_index, conn);
+            conn->port = port;
+            conn->local = *local;
+            conn->remote = *remote;
+            hash_index_insert(&conn_index, conn);
         }
     }
     if (conn) {
         /* Initialise the structure */
         /* TODO: should probably initialise more of this */
-        conn->port = port;
-        conn->local = *local;
-        conn->remote = *remote;
-        conn->snd_state = 0;
-        conn->ack_state = 0;
-        conn->rcv_state = 0;
-        conn->window_size = 0;
-        conn->t1_expiry = INSTANT_ZERO;
-        conn->t2_expiry = INSTANT_ZERO;
-        conn->t3_expiry = INSTANT_ZERO;
-        conn->state = STATE_DISCONNECTED;
+        conn->hot.snd_state = 0;
+        conn->hot.ack_state = 0;
+        conn->hot.rcv_state = 0;
+        conn->hot.window_size = 0;
+        conn_ring_release(conn);
+        timeout_init(&conn->t1, conn_expire_t1, conn);
+        timeout_init(&conn->t2, conn_expire_t2, conn);
+        timeout_init(&conn->t3, conn_expire_t3, conn);
+        conn_set_xmit_id(conn, 0);
+        conn->hot.pool_busy = false;
+        conn_set_path(conn, NULL, 0);
+        conn->hot.state = STATE_DISCONNECTED;
     } else {
         /* Record that there were no more available connctions */
         metric_inc(METRIC_NO_CONNS);
@@ -63,87 +362,102 @@ connection_t *conn_find_or_create(ssid_t *local, ssid_t *remote, uint8_t port) {
     return conn;
 }
 
+void conn_set_path(connection_t *conn, const ssid_t via[], size_t via_count) {
+    CHECK(via_count <= MAX_ADDRESSES - ADDR_DIGI1);
+    uint8_t *addrs = conn->addrs[0];
+
+    ssid_encode(&conn->remote, &addrs[ADDR_DST * SSID_LEN]);
+    ssid_encode(&conn->local, &addrs[ADDR_SRC * SSID_LEN]);
+    for(size_t i = 0; i < via_count; ++i)
+        ssid_encode(&via[via_count - 1 - i], &addrs[(ADDR_DIGI1 + i) * SSID_LEN]);
+    conn->addrs_len = (ADDR_DIGI1 + via_count) * SSID_LEN;
+
+    /* add end of addresses marker */
+    addrs[conn->addrs_len - 1] |= 0b00000001;
+
+    /* The command variant only differs in which C bit is set */
+    memcpy(conn->addrs[1], addrs, conn->addrs_len);
+    conn->addrs[0][(ADDR_SRC + 1) * SSID_LEN - 1] |= 0b10000000;
+    conn->addrs[1][(ADDR_DST + 1) * SSID_LEN - 1] |= 0b10000000;
+}
+
 void conn_release(connection_t *connection) {
-    CHECK(connection->state == STATE_DISCONNECTED);
-    CHECK(instant_cmp(connection->t1_expiry, INSTANT_ZERO) == 0);
-    CHECK(instant_cmp(connection->t3_expiry, INSTANT_ZERO) == 0);
-}
-
-static duration_t conn_expire_timers(void) {
-    instant_t now;
-    instant_t next;
-    bool triggered;
-    do {
-        triggered = false;
-        now = instant_now();
-        next = instant_add(now, duration_seconds(3600));
-
-        for(size_t i = 0; i < MAX_CONN; ++i) {
-
-            if (conntbl[i].state == STATE_DISCONNECTED)
-                continue;
-
-            if (instant_cmp(conntbl[i].t1_expiry, INSTANT_ZERO) != 0) {
-                if (instant_cmp(conntbl[i].t1_expiry, now) <= 0) {
-                    ax25_dl_event_t ev;
-                    conntbl[i].t1_expiry = INSTANT_ZERO;
-                    ev.event = EV_TIMER_EXPIRE_T1;
-                    ev.conn = &conntbl[i];
-                    ev.address_count = 0;
-                    ax25_dl_event(&ev);
-                    triggered = true;
-                } else
-                    next = instant_min(next, conntbl[i].t1_expiry);
-            }
-
-            if (instant_cmp(conntbl[i].t2_expiry, INSTANT_ZERO) != 0) {
-                if (instant_cmp(conntbl[i].t2_expiry, now) <= 0) {
-                    ax25_dl_event_t ev;
-                    conntbl[i].t2_expiry = INSTANT_ZERO;
-                    ev.event = EV_TIMER_EXPIRE_T2;
-                    ev.conn = &conntbl[i];
-                    ev.address_count = 0;
-                    ax25_dl_event(&ev);
-                    triggered = true;
-                } else
-                    next = instant_min(next, conntbl[i].t2_expiry);
-            }
-
-            if (instant_cmp(conntbl[i].t3_expiry, INSTANT_ZERO) != 0) {
-                if (instant_cmp(conntbl[i].t3_expiry, now) <= 0) {
-                    ax25_dl_event_t ev;
-                    conntbl[i].t3_expiry = INSTANT_ZERO;
-                    ev.event = EV_TIMER_EXPIRE_T3;
-                    ev.conn = &conntbl[i];
-                    ev.address_count = 0;
-                    ax25_dl_event(&ev);
-                    triggered = true;
-                } else
-                    next = instant_min(next, conntbl[i].t3_expiry);
-            }
-        }
-    } while (triggered);
+    CHECK(connection->hot.state == STATE_DISCONNECTED);
+    CHECK(!timeout_running(&connection->t1));
+    CHECK(!timeout_running(&connection->t3));
+    /* T2 (delayed acks) may still be pending, but there's nobody left to ack */
+    timeout_stop(&connection->t2);
+    conn_set_xmit_id(connection, 0);
+    conn_ring_release(connection);
+    hash_index_remove(&conn_index, connection);
+    conn_push_free(connection);
+}
 
-    return instant_sub(next, now);
+/* Connections that have been scheduled, linked through next_active */
+static connection_t *active_conns = NULL;
+
+void conn_schedule(connection_t *conn) {
+    if (conn->active)
+        return;
+    conn->active = true;
+    conn->next_active = active_conns;
+    active_conns = conn;
+    platform_wakeup();
+}
+
+/* Send what conn has queued, as far as the window allows.
+ *
+ * Returns true if it's held up by the TNC, or busy because buffers are low,
+ * and needs looking at again once that clears (which wakes the platform).
+ */
+static bool conn_drain(connection_t *conn) {
+    if (conn->hot.state == STATE_DISCONNECTED)
+        return false;
+
+    dl_update_pool_busy(conn);
+    while (conn->hot.state != STATE_DISCONNECTED && !conn->hot.peer_busy && conn->hot.send_queue_head) {
+        if (kiss_xmit_congested(conn->port)) {
+            /* Leave it queued until the serial link catches up */
+            return true;
+        }
+        buffer_t *head = conn->hot.send_queue_head;
+        ax25_dl_event_t ev;
+        ev.conn = conn;
+        ev.event = EV_DRAIN_SENDQ;
+        ev.address_count = 0;
+        ax25_dl_event(&ev);
+        if (conn->hot.send_queue_head == head) {
+            /* The window is full, acks will schedule it again */
+            break;
+        }
+    }
+    return conn->hot.state != STATE_DISCONNECTED && conn->hot.pool_busy;
 }
 
 static duration_t conn_dequeue(void) {
-    duration_t duration = duration_seconds(3600);
-    for(size_t i = 0; i < MAX_CONN; ++i) {
-        if (conntbl[i].state == STATE_DISCONNECTED)
-            continue;
-
-        if (!conntbl[i].peer_busy && conntbl[i].send_queue_head) {
-            ax25_dl_event_t ev;
-            ev.conn = &conntbl[i];
-            ev.event = EV_DRAIN_SENDQ;
-            ev.address_count = 0;
-            ax25_dl_event(&ev);
-            duration = duration_millis(20);
+    /* Connections stay marked active while they're drained, so the events
+     * sending them raises don't schedule them again */
+    connection_t *conn = active_conns;
+    connection_t *waiting = NULL;
+    active_conns = NULL;
+    while (conn) {
+        connection_t *next = conn->next_active;
+        if (conn_drain(conn)) {
+            conn->next_active = waiting;
+            waiting = conn;
+        } else {
+            conn->active = false;
         }
+        conn = next;
+    }
+    while (waiting) {
+        connection_t *next = waiting->next_active;
+        waiting->next_active = active_conns;
+        active_conns = waiting;
+        waiting = next;
     }
 
-    return duration;
+    return duration_seconds(3600);
 }
 
 static ticker_t conn_dequeue_ticker = {
@@ -153,7 +467,7 @@ static ticker_t conn_dequeue_ticker = {
 
 static ticker_t conn_expire_ticker = {
     .next = NULL,
-    .tick = conn_expire_timers,
+    .tick = timeout_run,
 };
 
 void ax25_init(void) {
@@ -0,0 +1,132 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * CRC calculations.
+ *
+ * Uses "slicing by 8": eight tables let us fold eight bytes into the CRC per
+ * iteration instead of one.  The tables are built on first use.
+ */
+#include "crc.h"
+#include "debug.h"
+#include <stdbool.h>
+
+enum {
+    CRC16_POLY = 0xA001, /* 0x8005 bit reversed */
+    CRC_CCITT_POLY = 0x8408, /* 0x1021 bit reversed */
+    CRC_FLEX_XOR = 0x0F87,
+    CRC_SLICES = 8,
+};
+
+static uint16_t crc16_table[CRC_SLICES][256];
+static bool crc16_table_ready = false;
+
+static void crc16_init(void) {
+    for (size_t i = 0; i < 256; ++i) {
+        uint16_t crc = i;
+        for (size_t bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC16_POLY : crc >> 1;
+        crc16_table[0][i] = crc;
+    }
+    /* Table n is the effect of a byte followed by n zero bytes */
+    for (size_t slice = 1; slice < CRC_SLICES; ++slice) {
+        for (size_t i = 0; i < 256; ++i) {
+            uint16_t crc = crc16_table[slice - 1][i];
+            crc16_table[slice][i] = (crc >> 8) ^ crc16_table[0][crc & 0xFF];
+        }
+    }
+    crc16_table_ready = true;
+}
+
+uint16_t crc16(uint16_t crc, const uint8_t *buf, size_t len) {
+    if (!crc16_table_ready)
+        crc16_init();
+
+    while (len >= CRC_SLICES) {
+        crc ^= buf[0] | (buf[1] << 8);
+        crc = crc16_table[7][crc & 0xFF]
+            ^ crc16_table[6][crc >> 8]
+            ^ crc16_table[5][buf[2]]
+            ^ crc16_table[4][buf[3]]
+            ^ crc16_table[3][buf[4]]
+            ^ crc16_table[2][buf[5]]
+            ^ crc16_table[1][buf[6]]
+            ^ crc16_table[0][buf[7]];
+        buf += CRC_SLICES;
+        len -= CRC_SLICES;
+    }
+
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crc16_table[0][(crc ^ *buf++) & 0xFF];
+
+    return crc;
+}
+
+/* FlexNet's table is CRC-CCITT's bit reversed table with every entry xored
+ * with CRC_FLEX_XOR, but it's applied most significant byte first.  That makes
+ * each step affine rather than linear: crc_flex_table[0] is the byte at a time
+ * table as FlexNet (and Linux's mkiss) have it, the other slices are the
+ * linear part only, and crc_flex_slice_xor is what the constants add up to
+ * over CRC_SLICES bytes.
+ */
+static uint16_t crc_flex_table[CRC_SLICES][256];
+static uint16_t crc_flex_slice_xor;
+static bool crc_flex_table_ready = false;
+
+static void crc_flex_init(void) {
+    uint16_t linear[256];
+    for (size_t i = 0; i < 256; ++i) {
+        uint16_t crc = i;
+        for (size_t bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC_CCITT_POLY : crc >> 1;
+        linear[i] = crc;
+        crc_flex_table[0][i] = crc ^ CRC_FLEX_XOR;
+    }
+    /* Table n is the effect of a byte followed by n zero bytes */
+    for (size_t i = 0; i < 256; ++i)
+        crc_flex_table[1][i] = (uint16_t)(linear[i] << 8) ^ linear[linear[i] >> 8];
+    for (size_t slice = 2; slice < CRC_SLICES; ++slice) {
+        for (size_t i = 0; i < 256; ++i) {
+            uint16_t crc = crc_flex_table[slice - 1][i];
+            crc_flex_table[slice][i] = (uint16_t)(crc << 8) ^ linear[crc >> 8];
+        }
+    }
+    uint16_t zeroes = 0;
+    for (size_t i = 0; i < CRC_SLICES; ++i)
+        zeroes = (uint16_t)(zeroes << 8) ^ crc_flex_table[0][zeroes >> 8];
+    crc_flex_slice_xor = zeroes ^ CRC_FLEX_XOR;
+    crc_flex_table_ready = true;
+
+    /* A SABM from R00000-1 to NOCALL-3 on unit 0, with the CRC worked out
+     * the byte at a time way, as FlexNet and mkiss do */
+    static const uint8_t frame[] = {
+        0x20, 0x9C, 0x9E, 0x86, 0x82, 0x98, 0x98, 0xE6,
+        0xA4, 0x60, 0x60, 0x60, 0x60, 0x60, 0x63, 0x3F,
+        0x44, 0x8F,
+    };
+    CHECK(crc_flex(CRC_FLEX_INIT, frame, sizeof(frame) - 2) == 0x448F);
+    CHECK(crc_flex(CRC_FLEX_INIT, frame, sizeof(frame)) == CRC_FLEX_GOOD);
+}
+
+uint16_t crc_flex(uint16_t crc, const uint8_t *buf, size_t len) {
+    if (!crc_flex_table_ready)
+        crc_flex_init();
+
+    while (len >= CRC_SLICES) {
+        crc = crc_flex_table[7][(crc >> 8) ^ buf[0]]
+            ^ crc_flex_table[6][(crc & 0xFF) ^ buf[1]]
+            ^ crc_flex_table[5][buf[2]]
+            ^ crc_flex_table[4][buf[3]]
+            ^ crc_flex_table[3][buf[4]]
+            ^ crc_flex_table[2][buf[5]]
+            ^ crc_flex_table[1][buf[6]]
+            ^ crc_flex_table[0][buf[7]]
+            ^ crc_flex_slice_xor;
+        buf += CRC_SLICES;
+        len -= CRC_SLICES;
+    }
+
+    while (len-- > 0)
+        crc = (uint16_t)(crc << 8) ^ crc_flex_table[0][(crc >> 8) ^ *buf++];
+
+    return crc;
+}
@@ -0,0 +1,82 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * AX.25 control field decoding.
+ */
+#include "frame.h"
+#include "ax25_dl.h"
+
+/* Control field
+ *
+ *                  7 6 5   4   3 2 1   0
+ * I frame (mod 8): N(R)  | P | N(S)  | 0
+ * S frame (mod 8): N(R)  |P/F| S S 0   1
+ * U frame:         M M M |P/F| M M 1   1
+ *
+ * Modulo 128 I and S frames have a second byte holding N(R) and P/F, and use
+ * all 7 high bits of the first byte for N(S).
+ */
+
+#define IS_I(c) (((c) & 0b00000001) == 0)
+#define IS_U(c) (((c) & 0b00000011) == 0b11)
+
+#define S_EVENT(c) \
+    (((c) & 0b00001100) == 0b00000000 ? EV_RR : \
+     ((c) & 0b00001100) == 0b00000100 ? EV_RNR : \
+     ((c) & 0b00001100) == 0b00001000 ? EV_REJ : \
+                                        EV_SREJ)
+
+#define U_EVENT(c) \
+    (((c) & 0b11101100) == 0b00101100 ? EV_SABM : \
+     ((c) & 0b11101100) == 0b01101100 ? EV_SABME : \
+     ((c) & 0b11101100) == 0b01000000 ? EV_DISC : \
+     ((c) & 0b11101100) == 0b00001100 ? EV_DM : \
+     ((c) & 0b11101100) == 0b01100000 ? EV_UA : \
+     ((c) & 0b11101100) == 0b10000100 ? EV_FRMR : \
+     ((c) & 0b11101100) == 0b00000000 ? EV_UI : \
+     ((c) & 0b11101100) == 0b10101100 ? EV_XID : \
+     ((c) & 0b11101100) == 0b11100000 ? EV_TEST : \
+                                        EV_UNKNOWN_FRAME)
+
+#define EVENT(c) (IS_I(c) ? EV_I : IS_U(c) ? U_EVENT(c) : S_EVENT(c))
+
+/* Descriptor for the first (or only) byte of a modulo 8 control field */
+#define CONTROL8(c) { \
+    .event = EVENT(c), \
+    .len = 1, \
+    .pf = ((c) >> 4) & 1, \
+    .nr = IS_U(c) ? 0 : (c) >> 5, \
+    .ns = IS_I(c) ? ((c) >> 1) & 0b111 : 0, \
+}
+
+/* Descriptor for the first byte of a modulo 128 control field, N(R) and P/F
+ * come from the second byte. */
+#define CONTROL16(c) { \
+    .event = EVENT(c), \
+    .len = IS_U(c) ? 1 : 2, \
+    .pf = IS_U(c) ? ((c) >> 4) & 1 : 0, \
+    .nr = 0, \
+    .ns = IS_I(c) ? (c) >> 1 : 0, \
+}
+
+#define ROW4(f, c) f(c), f((c) + 1), f((c) + 2), f((c) + 3)
+#define ROW16(f, c) ROW4(f, c), ROW4(f, (c) + 4), ROW4(f, (c) + 8), ROW4(f, (c) + 12)
+#define ROW64(f, c) ROW16(f, c), ROW16(f, (c) + 16), ROW16(f, (c) + 32), ROW16(f, (c) + 48)
+#define ROW256(f) ROW64(f, 0), ROW64(f, 64), ROW64(f, 128), ROW64(f, 192)
+
+static const frame_desc_t control8[256] = { ROW256(CONTROL8) };
+static const frame_desc_t control16[256] = { ROW256(CONTROL16) };
+
+bool frame_decode(const uint8_t control[], size_t len, bool extended, frame_desc_t *desc) {
+    if (len < 1)
+        return false;
+    *desc = (extended ? control16 : control8)[control[0]];
+    if (desc->len == 1)
+        return true;
+
+    if (len < 2)
+        return false;
+    desc->pf = control[1] & 0b00000001;
+    desc->nr = control[1] >> 1;
+    return true;
+}
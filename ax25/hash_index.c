@@ -0,0 +1,69 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Open addressing hash index over entries stored elsewhere.
+ */
+#include "hash_index.h"
+#include "debug.h"
+
+static size_t hash_index_home(const hash_index_t *index, const void *entry) {
+    return index->hash(entry) % index->size;
+}
+
+void hash_index_insert(hash_index_t *index, void *entry) {
+    size_t i = hash_index_home(index, entry);
+    for (size_t probes = 0; index->slots[i]; ++probes) {
+        CHECK(probes < index->size);
+        i = (i + 1) % index->size;
+    }
+    index->slots[i] = entry;
+}
+
+void hash_index_remove(hash_index_t *index, void *entry) {
+    size_t i = hash_index_home(index, entry);
+    while (index->slots[i] != entry) {
+        if (!index->slots[i])
+            return;
+        i = (i + 1) % index->size;
+    }
+
+    /* Backward shift: pull later entries in this probe run into the hole,
+     * unless doing so would move them before their home slot. */
+    for (;;) {
+        index->slots[i] = NULL;
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) % index->size;
+            if (!index->slots[j])
+                return;
+            size_t home = hash_index_home(index, index->slots[j]);
+            bool home_in_gap = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!home_in_gap)
+                break;
+        }
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+}
+
+void hash_index_resize(hash_index_t *index, void **slots, size_t size) {
+    void **old_slots = index->slots;
+    size_t old_size = index->size;
+    index->slots = slots;
+    index->size = size;
+    for (size_t i = 0; i < old_size; ++i) {
+        if (old_slots[i]) {
+            hash_index_insert(index, old_slots[i]);
+            old_slots[i] = NULL;
+        }
+    }
+}
+
+void *hash_index_find(const hash_index_t *index, uint32_t hash,
+        bool (*match)(const void *entry, const void *key), const void *key) {
+    for (size_t i = hash % index->size; index->slots[i]; i = (i + 1) % index->size) {
+        if (match(index->slots[i], key))
+            return index->slots[i];
+    }
+    return NULL;
+}
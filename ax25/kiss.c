@@ -7,11 +7,11 @@
 #include "ax25.h"
 #include "capture.h"
 #include "config.h"
+#include "crc.h"
 #include "debug.h"
 #include "metric.h"
 #include "serial.h"
-
-#undef ACKMODE
+#include <string.h> // for memcpy
 
 enum {
     FEND = 0xC0,
@@ -31,6 +31,13 @@ enum {
     KISS_FEC = 8, /* FEC? */
     KISS_ACKMODE = 12, /* 2 byte ID, N bytes data */
     KISS_POLL = 14, /* 0 bytes data */
+
+    SMACK_CRC = 0x80, /* Set in the command byte of SMACK data frames carrying a CRC */
+    FLEXNET_CRC = 0x20, /* Set in the command byte of FlexNet data frames carrying a CRC */
+    /* Plain data frames in a row, after we've sent a CRC frame, before we
+     * decide the TNC doesn't speak CRCs.  Frames it already had queued
+     * when it switched can be plain. */
+    CRC_FALLBACK_FRAMES = 4,
 };
 
 static uint8_t buffer[MAX_SERIAL][BUFFER_SIZE];
@@ -44,6 +51,36 @@ static enum kiss_state_t {
 
 static uint16_t next_id = 0;
 
+/* Bitmask of which units on each serial link have ACKMODE enabled */
+static uint16_t ackmode_units[MAX_SERIAL] = {0, };
+
+/* Which CRC (if any) is configured on each serial link.
+ *
+ * SMACK and FlexNet work the same way, they just flag CRC frames with a
+ * different bit in the command byte and use a different CRC.
+ */
+static enum kiss_crc_t {
+    KISS_CRC_NONE,
+    KISS_CRC_SMACK,
+    KISS_CRC_FLEXNET,
+} crc_mode[MAX_SERIAL] = { KISS_CRC_NONE, };
+
+/* CRC state per serial link.
+ *
+ * When negotiating we send CRC frames, a SMACK or FlexNet TNC switches to CRC
+ * mode when it sees one.  Receiving a valid CRC frame confirms the TNC speaks
+ * it, receiving CRC_FALLBACK_FRAMES plain data frames in a row after we've
+ * sent a CRC frame means it doesn't.  While a CRC is configured, CRC frames
+ * are still checked after falling back, and a valid one turns it back on.
+ */
+static enum crc_state_t {
+    CRC_OFF,
+    CRC_NEGOTIATE,
+    CRC_ON,
+} crc_state[MAX_SERIAL] = { CRC_OFF, };
+static bool crc_sent[MAX_SERIAL] = { false, };
+static uint8_t crc_plain_frames[MAX_SERIAL] = { 0, }; //< Plain data frames in a row
+
 /* Internally we use "port" to refer to which port something came from.
  * But there can be multiple ports on one serial link, or multiple serial links.
  * So we use "serial" to describe which serial link, and "unit" within a serial link.
@@ -59,25 +96,84 @@ static uint8_t serial_unit_to_port(uint8_t serial, uint8_t port) {
     return (serial << 4) | port;
 }
 
+/* The command byte bit that marks a data frame as carrying a CRC */
+static uint8_t kiss_crc_flag(uint8_t serial) {
+    return crc_mode[serial] == KISS_CRC_FLEXNET ? FLEXNET_CRC : SMACK_CRC;
+}
+
+/* The CRC can only be sent on units that don't use the flag bit */
+static bool kiss_crc_unit(uint8_t serial, uint8_t unit) {
+    return ((unit << 4) & kiss_crc_flag(serial)) == 0;
+}
+
+/* Check the CRC over a frame, including the CRC itself */
+static bool kiss_crc_valid(uint8_t serial, const uint8_t *frame, size_t len) {
+    if (crc_mode[serial] == KISS_CRC_FLEXNET)
+        return crc_flex(CRC_FLEX_INIT, frame, len) == CRC_FLEX_GOOD;
+    return crc16(0, frame, len) == 0;
+}
+
+/* Verify and strip the CRC.  Returns false if the frame should be dropped. */
+static bool kiss_check_crc(uint8_t serial, size_t *len) {
+    uint8_t *frame = buffer[serial];
+    if (frame[0] & kiss_crc_flag(serial)) {
+        if (*len < 3 || !kiss_crc_valid(serial, frame, *len)) {
+            metric_inc(METRIC_KISS_BAD_CRC);
+            return false;
+        }
+        if (crc_state[serial] != CRC_ON)
+            DEBUG(STR("KISS CRC enabled on serial "), D8(serial));
+        crc_state[serial] = CRC_ON;
+        crc_plain_frames[serial] = 0;
+        frame[0] &= ~kiss_crc_flag(serial);
+        *len -= 2;
+        return true;
+    }
+
+    if ((frame[0] & 0x0F) != KISS_DATA)
+        return true; /* Only data frames carry a CRC */
+
+    if (crc_state[serial] == CRC_OFF)
+        return true;
+
+    if (crc_sent[serial] && crc_plain_frames[serial] < CRC_FALLBACK_FRAMES
+            && ++crc_plain_frames[serial] == CRC_FALLBACK_FRAMES) {
+        DEBUG(STR("TNC doesn't support KISS CRCs on serial "), D8(serial));
+        crc_state[serial] = CRC_OFF;
+        return true;
+    }
+
+    if (crc_state[serial] == CRC_ON) {
+        /* Can't tell if this was corrupted or not */
+        metric_inc(METRIC_KISS_BAD_CRC);
+        return false;
+    }
+    return true;
+}
+
 static void kiss_recv(uint8_t serial) {
-    if (buffer_len[serial] < 1) {
+    size_t len = buffer_len[serial];
+    if (len < 1) {
         /* Ignore zero length frames - they're padding */
         return;
     }
+    if (crc_mode[serial] != KISS_CRC_NONE && !kiss_check_crc(serial, &len))
+        return;
     switch (buffer[serial][0] & 0x0F) {
         case KISS_DATA:
-            ax25_recv(serial_unit_to_port(serial, buffer[serial][0] >> 4), &buffer[serial][1], buffer_len[serial]-1);
+            ax25_recv(serial_unit_to_port(serial, buffer[serial][0] >> 4), &buffer[serial][1], len-1);
             break;
         case KISS_ACKMODE:
-            if (buffer_len[serial] < 3) {
+            if (len < 3) {
                 metric_inc(METRIC_UNDERRUN);
                 return;
             }
-            /* TODO: range check */
+            /* A frame with just the id is the TNC acknowledging that it has
+             * finished transmitting that frame. */
             ax25_recv_ackmode(serial_unit_to_port(serial, buffer[serial][0] >> 4),
                     buffer[serial][1] << 8 | buffer[serial][2],
                     &buffer[serial][3],
-                    buffer_len[serial]-3);
+                    len-3);
             break;
         default:
             DEBUG(STR("Unexpected kiss command from TNC: "), X8(buffer[serial][0]));
@@ -150,67 +246,193 @@ void kiss_recv_byte(uint8_t serial, uint8_t byte) {
     }
 }
 
-static void kiss_xmit_byte(uint8_t serial, uint8_t byte) {
-    switch(byte) {
-        case FEND:
-            serial_putch(serial, FESC);
-            serial_putch(serial, TFEND);
-            break;
-        case FESC:
-            serial_putch(serial, FESC);
-            serial_putch(serial, TFESC);
+/* Returns true if any of the bytes in word are equal to byte.
+ *
+ * This is the classic "does this word have a zero byte" trick: xor with the
+ * byte we're looking for in every position, then look for a zero byte.  This
+ * lets us check sizeof(size_t) bytes at a time without branching on each one.
+ */
+static bool word_has_byte(size_t word, uint8_t byte) {
+    const size_t ones = SIZE_MAX / 0xFF; /* 0x0101...01 */
+    const size_t highs = ones * 0x80; /* 0x8080...80 */
+    size_t x = word ^ (ones * byte);
+    return ((x - ones) & ~x & highs) != 0;
+}
+
+/* Returns the offset of the first FEND or FESC in buf, or len if there are none. */
+static size_t kiss_find_special(const uint8_t *buf, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+        size_t word;
+        memcpy(&word, &buf[i], sizeof(word));
+        if (word_has_byte(word, FEND) || word_has_byte(word, FESC))
             break;
-        default:
-            serial_putch(serial, byte);
+    }
+    for (; i < len; ++i) {
+        if (buf[i] == FEND || buf[i] == FESC)
             break;
     }
+    return i;
+}
+
+void kiss_recv_buffer(uint8_t serial, const uint8_t *buf, size_t len) {
+    if (serial >= MAX_SERIAL)
+        return;
+    size_t i = 0;
+    while (i < len) {
+        if (kiss_state[serial] == STATE_ESCAPE) {
+            kiss_recv_byte(serial, buf[i++]);
+            continue;
+        }
+
+        /* Everything up to the next FEND/FESC is either ignored (while
+         * waiting for the start of a frame), or is frame data that can be
+         * copied in one go.
+         */
+        size_t run = kiss_find_special(&buf[i], len - i);
+        if (kiss_state[serial] == STATE_DATA && run > 0) {
+            size_t space = BUFFER_SIZE - buffer_len[serial];
+            if (run >= space) {
+                /* Same as the byte path: fill the buffer, then give up on
+                 * this frame and wait for the next FEND */
+                memcpy(&buffer[serial][buffer_len[serial]], &buf[i], space);
+                buffer_len[serial] += space;
+                kiss_state[serial] = STATE_WAIT;
+                metric_inc(METRIC_OVERRUN);
+                i += space;
+                continue;
+            }
+            memcpy(&buffer[serial][buffer_len[serial]], &buf[i], run);
+            buffer_len[serial] += run;
+        }
+        i += run;
+
+        /* Delimiters and escapes go through the byte at a time state machine */
+        if (i < len)
+            kiss_recv_byte(serial, buf[i++]);
+    }
+}
+
+/* Frames are encoded here before being handed to the serial port in one go.
+ *
+ * Worst case every byte of the command, ACKMODE id, payload and CRC needs
+ * escaping, plus the two FENDs.
+ */
+static uint8_t xmit_buffer[2 * (1 + 2 + MAX_PACKET_SIZE + 2) + 2];
+
+/* Escape src onto the end of xmit_buffer, returns the new length. */
+static size_t kiss_escape(size_t offset, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        size_t run = kiss_find_special(&src[i], len - i);
+        memcpy(&xmit_buffer[offset], &src[i], run);
+        offset += run;
+        i += run;
+        if (i < len) {
+            xmit_buffer[offset++] = FESC;
+            xmit_buffer[offset++] = src[i++] == FEND ? TFEND : TFESC;
+        }
+    }
+    return offset;
+}
+
+/* Encode a complete frame (header + payload) and send it with a single write */
+static void kiss_send_frame(uint8_t serial, const uint8_t *header, size_t header_len, const uint8_t *payload, size_t len, enum kiss_crc_t with_crc) {
+    CHECK(header_len <= 3 && len <= MAX_PACKET_SIZE);
+    size_t offset = 0;
+    xmit_buffer[offset++] = FEND;
+    offset = kiss_escape(offset, header, header_len);
+    offset = kiss_escape(offset, payload, len);
+    if (with_crc == KISS_CRC_SMACK) {
+        uint16_t crc = crc16(crc16(0, header, header_len), payload, len);
+        const uint8_t trailer[] = { crc & 0xFF, crc >> 8 };
+        offset = kiss_escape(offset, trailer, sizeof(trailer));
+    } else if (with_crc == KISS_CRC_FLEXNET) {
+        uint16_t crc = crc_flex(crc_flex(CRC_FLEX_INIT, header, header_len), payload, len);
+        const uint8_t trailer[] = { crc >> 8, crc & 0xFF };
+        offset = kiss_escape(offset, trailer, sizeof(trailer));
+    }
+    xmit_buffer[offset++] = FEND;
+    serial_write(serial, xmit_buffer, offset);
+}
+
+static bool kiss_ackmode_enabled(uint8_t port) {
+    return port_to_serial(port) < MAX_SERIAL
+        && (ackmode_units[port_to_serial(port)] & (1 << port_to_unit(port))) != 0;
+}
+
+bool kiss_xmit_congested(uint8_t port) {
+    return serial_tx_congested(port_to_serial(port));
 }
 
 uint16_t kiss_xmit(uint8_t port, uint8_t *buffer, size_t len) {
-    uint16_t id;
+    uint16_t id = 0;
     capture_trigger(DIR_OUT, buffer, len);
-    do {
-        id = next_id++;
-    } while (id == 0);
-
-    serial_putch(port_to_serial(port), FEND);
-#ifdef ACKMODE
-    kiss_xmit_byte(port_to_serial(port), (port_to_unit(port) << 4) | KISS_ACKMODE);
-    kiss_xmit_byte(port_to_serial(port), id >> 8);
-    kiss_xmit_byte(port_to_serial(port), id & 0xFF);
-#else
-    kiss_xmit_byte(port_to_serial(port), (port_to_unit(port) << 4) | KISS_DATA);
-#endif
-    for (size_t i = 0; i < len; ++i) {
-        kiss_xmit_byte(port_to_serial(port), buffer[i]);
+
+    if (kiss_ackmode_enabled(port)) {
+        do {
+            id = next_id++;
+        } while (id == 0);
+
+        const uint8_t header[] = { (port_to_unit(port) << 4) | KISS_ACKMODE, id >> 8, id & 0xFF };
+        kiss_send_frame(port_to_serial(port), header, sizeof(header), buffer, len, KISS_CRC_NONE);
+    } else if (port_to_serial(port) < MAX_SERIAL
+            && crc_state[port_to_serial(port)] != CRC_OFF
+            && kiss_crc_unit(port_to_serial(port), port_to_unit(port))) {
+        uint8_t serial = port_to_serial(port);
+        const uint8_t header[] = { (port_to_unit(port) << 4) | KISS_DATA | kiss_crc_flag(serial) };
+        kiss_send_frame(serial, header, sizeof(header), buffer, len, crc_mode[serial]);
+        crc_sent[serial] = true;
+    } else {
+        const uint8_t header[] = { (port_to_unit(port) << 4) | KISS_DATA };
+        kiss_send_frame(port_to_serial(port), header, sizeof(header), buffer, len, KISS_CRC_NONE);
     }
-    serial_putch(port_to_serial(port), FEND);
     metric_inc(METRIC_KISS_XMIT);
     metric_inc_by(METRIC_KISS_XMIT_BYTES, len);
 
     return id;
 }
 
+static void kiss_xmit_command(uint8_t port, uint8_t command, uint8_t value) {
+    const uint8_t header[] = { (port_to_unit(port) << 4) | command };
+    kiss_send_frame(port_to_serial(port), header, sizeof(header), &value, sizeof(value), KISS_CRC_NONE);
+}
+
 void kiss_set_txdelay(uint8_t port, uint8_t delay) {
-    kiss_xmit_byte(port_to_serial(port), FEND);
-    kiss_xmit_byte(port_to_serial(port), (port_to_unit(port) << 4) | KISS_TXDELAY);
-    kiss_xmit_byte(port_to_serial(port), delay);
-    kiss_xmit_byte(port_to_serial(port), FEND);
+    kiss_xmit_command(port, KISS_TXDELAY, delay);
     DEBUG(STR("set txdelay"));
 }
 
 void kiss_set_slottime(uint8_t port, uint8_t delay) {
-    kiss_xmit_byte(port_to_serial(port), FEND);
-    kiss_xmit_byte(port_to_serial(port), (port_to_unit(port) << 4) | KISS_SLOTTIME);
-    kiss_xmit_byte(port_to_serial(port), delay);
-    kiss_xmit_byte(port_to_serial(port), FEND);
+    kiss_xmit_command(port, KISS_SLOTTIME, delay);
     DEBUG(STR("set slottime"));
 }
 
 void kiss_set_duplex(uint8_t port, bool full_duplex) {
-    kiss_xmit_byte(port_to_serial(port), FEND);
-    kiss_xmit_byte(port_to_serial(port), (port_to_unit(port) << 4) | KISS_FULLDUP);
-    kiss_xmit_byte(port_to_serial(port), full_duplex ? 1 : 0);
-    kiss_xmit_byte(port_to_serial(port), FEND);
+    kiss_xmit_command(port, KISS_FULLDUP, full_duplex ? 1 : 0);
     DEBUG(STR("set duplex"));
 }
+
+void kiss_set_ackmode(uint8_t port, bool enabled) {
+    CHECK(port_to_serial(port) < MAX_SERIAL);
+    if (enabled)
+        ackmode_units[port_to_serial(port)] |= 1 << port_to_unit(port);
+    else
+        ackmode_units[port_to_serial(port)] &= ~(1 << port_to_unit(port));
+}
+
+static void kiss_set_crc(uint8_t serial, enum kiss_crc_t mode) {
+    CHECK(serial < MAX_SERIAL);
+    crc_mode[serial] = mode;
+    crc_state[serial] = mode != KISS_CRC_NONE ? CRC_NEGOTIATE : CRC_OFF;
+    crc_sent[serial] = false;
+    crc_plain_frames[serial] = 0;
+}
+
+void kiss_set_smack(uint8_t serial, bool enabled) {
+    kiss_set_crc(serial, enabled ? KISS_CRC_SMACK : KISS_CRC_NONE);
+}
+
+void kiss_set_flexnet_crc(uint8_t serial, bool enabled) {
+    kiss_set_crc(serial, enabled ? KISS_CRC_FLEXNET : KISS_CRC_NONE);
+}
@@ -17,6 +17,7 @@ static const char *metric_name[MAX_METRIC] = {
     NAME(UNDERRUN),
     NAME(BAD_ESCAPE),
     NAME(UNKNOWN_KISS_COMMAND),
+    NAME(KISS_BAD_CRC),
     NAME(INVALID_ADDR),
     NAME(NOT_ME),
     NAME(NOT_ME_BYTES),
@@ -26,18 +27,20 @@ static const char *metric_name[MAX_METRIC] = {
     NAME(TEST_COMMAND_RECV),
     NAME(TEST_COMMAND_SENT),
     NAME(LEGACY_TYPE_RECV),
-    NAME(NO_PACKETS),
-    NAME(PACKETS_ALLOCATED),
-    NAME(PACKETS_FREED),
     NAME(NOT_COMMAND),
     NAME(SABM_SUCCESS),
     NAME(SABM_FAIL),
     NAME(NO_CONNS),
+    NAME(SMALL_WINDOW),
     NAME(KISS_XMIT),
     NAME(KISS_XMIT_BYTES),
     NAME(BUFFER_ALLOC_SUCCESS),
     NAME(BUFFER_ALLOC_FAIL),
     NAME(BUFFER_FREE),
+    NAME(BUFFER_SMALL_ALLOC),
+    NAME(BUFFER_MEDIUM_ALLOC),
+    NAME(BUFFER_LARGE_ALLOC),
+    NAME(BUFFER_SPILL),
 #undef NAME
 };
 
@@ -87,6 +87,8 @@ typedef enum ax25_dl_event_type_t {
     EV_DRAIN_SENDQ,
 } ax25_dl_event_type_t;
 
+enum { EV_COUNT = EV_DRAIN_SENDQ + 1 }; /* Number of events */
+
 typedef struct ax25_dl_event_t {
     ax25_dl_event_type_t event;
     uint8_t port;
@@ -100,11 +102,13 @@ typedef struct ax25_dl_event_t {
     bool f;
     ssid_t address[MAX_ADDRESSES];
     connection_t *conn;
-    packet_t *packet;
+    buffer_t *packet; /* EV_DL_DATA: the data, in a buffer ready to queue */
     struct dl_socket_t *socket;
 } ax25_dl_event_t;
 
 void ax25_dl_event(ax25_dl_event_t *ev);
+/** Called when the TNC reports (via ACKMODE) that frame id has been transmitted */
+void dl_xmit_complete(uint8_t port, uint16_t id);
 const char *ax25_dl_strerror(ax25_dl_error_t err);
 
 typedef enum dl_socket_type_t {
@@ -117,21 +121,42 @@ typedef struct dl_socket_t {
     dl_socket_type_t type;
     connection_t *conn;
     ssid_t local;
+    ssid_t remote; //< Only for DL_SOCK_CONNECTED
     void *userdata;
     void (*on_connect)(struct dl_socket_t *);
     void (*on_error)(struct dl_socket_t *, ax25_dl_error_t err);
     void (*on_data)(struct dl_socket_t *, const uint8_t *data, size_t datalen);
     void (*on_disconnect)(struct dl_socket_t *);
+    struct dl_socket_t *next_free; //< Only for DL_SOCK_CLOSED
 } dl_socket_t;
 
 /** Create a new connection to remote, from local, on port port */
 dl_socket_t *dl_connect(ssid_t *remote, ssid_t *local, uint8_t port);
-void dl_send(dl_socket_t *sock, const void *data, size_t datalen);
+typedef enum dl_send_result_t {
+    DL_SEND_OK,
+    DL_SEND_BUSY, /* Buffers are running low, try again later */
+} dl_send_result_t;
+
+/** Queue data to send on a connected socket */
+dl_send_result_t dl_send(dl_socket_t *sock, const void *data, size_t datalen);
+/** Go busy on conn while buffers are running low, and lift it once they've been freed */
+void dl_update_pool_busy(connection_t *conn);
+/* Listen on name.  A name with an SSID of SSID_WILDCARD (eg "NOCALL-*")
+ * accepts connections to any SSID of that callsign that doesn't have a
+ * listener of its own.
+ */
 dl_socket_t *dl_find_or_add_listener(ssid_t *name);
 /* Finds a socket with the local and remote sides.
- * Prefers connected sockets, over unconnected (listening) sockets.
+ * Prefers connected sockets, then a listener for local, then a wildcard
+ * listener for local's callsign.
  * Returns NULL if no socket found.
  */
 dl_socket_t *dl_find_socket(ssid_t *local, ssid_t *remote);
+/* Quick check for whether ssid could be one of our sockets.
+ *
+ * Never returns false for an ssid that dl_find_socket() would find, but may
+ * return true for some that it wouldn't.
+ */
+bool dl_maybe_local(const ssid_t *ssid);
 
 #endif
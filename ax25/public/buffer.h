@@ -5,18 +5,39 @@
  */
 #ifndef BUFFER_H
 #define BUFFER_H 1
+#include "config.h"
 #include <stdbool.h>
-#include "packet.h" // for MAX_PACKET_SIZE
+#include <stddef.h>
+#include <stdint.h>
 
+/* A reference counted buffer.
+ *
+ * Contents start BUFFER_HEADROOM bytes into the storage, so that a payload
+ * can be turned into a frame by prepending the address and control fields in
+ * place, rather than copying it into a new buffer.
+ */
 typedef struct buffer_t {
-    bool in_use;
-    uint8_t buffer[MAX_PACKET_SIZE];
-    size_t len;
     struct buffer_t *next;
+    uint8_t *buffer; //< Start of the contents
+    size_t len; //< Length of the contents
+    uint8_t *storage; //< Storage from the buffer's size class
+    size_t size; //< Bytes available at storage
+    uint8_t refs; //< References held, 0 if the buffer is free
 } buffer_t;
 
+/** Allocate a buffer holding a copy of src.  Returns NULL if there are no free buffers. */
 buffer_t *buffer_allocate(const uint8_t *src, size_t len);
+/** Allocate an empty buffer, with room to prepend len bytes. */
 buffer_t *buffer_allocate_with_size(size_t len);
+/** Take another reference to buffer. */
+buffer_t *buffer_ref(buffer_t *buffer);
+/** Drop a reference to *buffer, it's returned to the pool once the last reference is dropped. */
 void buffer_free(buffer_t **buffer);
+/** Grow the contents by len bytes at the front, returns the new start of the contents. */
+uint8_t *buffer_prepend(buffer_t *buffer, size_t len);
+/** Returns true while free buffers are running low (see BUFFER_LOW_WATER). */
+bool buffer_pool_low(void);
+/** Returns the number of bytes that can be prepended to buffer. */
+static inline size_t buffer_headroom(const buffer_t *buffer) { return buffer->buffer - buffer->storage; }
 
 #endif
@@ -9,13 +9,48 @@
 enum {
     MAX_SOCKETS = 16,
     T3_DURATION_MINUTES = 15,
-    MAX_BUFFERS = 20,
     MAX_CONN = 16,
     BUFFER_SIZE = 2048,
-    MAX_SERIAL = 2,
+    MAX_SERIAL = 4,
     MAX_PACKET_SIZE = 2048,
-    MAX_PACKETS = 20,
     MAX_ADDRESSES = 4,
+    /* Largest window (k) a connection uses.  Each link's retransmit and SREJ
+     * rings are sized to its own window, rounded up to a power of two.  Must
+     * be a power of two. */
+    MAX_WINDOW = 32,
+    /* Space kept free at the start of every buffer_t, for the address and
+     * control fields: MAX_ADDRESSES * SSID_LEN + 2 rounded up. */
+    BUFFER_HEADROOM = 32,
+    /* buffer_t pools, by size class, including the headroom.  Small
+     * interactive frames are the common case, so most buffers are small. */
+    SMALL_BUFFER_SIZE = 128,
+    MAX_SMALL_BUFFERS = 64,
+    MEDIUM_BUFFER_SIZE = 512,
+    MAX_MEDIUM_BUFFERS = 24,
+    LARGE_BUFFER_SIZE = MAX_PACKET_SIZE + BUFFER_HEADROOM,
+    MAX_LARGE_BUFFERS = 10,
+    MAX_BUFFERS = MAX_SMALL_BUFFERS + MAX_MEDIUM_BUFFERS + MAX_LARGE_BUFFERS,
+    /* When only BUFFER_LOW_WATER buffers are free, connections go busy (RNR)
+     * and dl_send() refuses new data, until BUFFER_HIGH_WATER are free again.
+     * The rest are kept for the protocol's own frames. */
+    BUFFER_LOW_WATER = MAX_BUFFERS / 8,
+    BUFFER_HIGH_WATER = MAX_BUFFERS / 4,
+    /* Fill freed buffers with POOL_POISON_BYTE, so use after free
+     * shows up as garbage rather than stale data */
+    POOL_POISON = 0,
+    POOL_POISON_BYTE = 0xDB,
+    MAX_TIMEOUTS = 3 * MAX_CONN, /* T1, T2 and T3 for every connection */
+    /* Once the static tables above are full, platforms with platform_alloc()
+     * grow them by slabs of this many entries. */
+    CONN_SLAB = 64,
+    /* Rings are carved from a static arena with room for MAX_CONN links at
+     * MAX_WINDOW, then from slabs with room for this many more. */
+    RING_SLAB = 16,
+    SOCKET_SLAB = 64,
+    BUFFER_SLAB = 32,
+    /* Most slabs each buffer size class grows by, so a flood of traffic
+     * meets flow control (see BUFFER_LOW_WATER) rather than eating memory. */
+    MAX_BUFFER_SLABS = 32,
 };
 
 #endif
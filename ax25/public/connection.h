@@ -6,9 +6,11 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 #include "debug.h"
+#include "config.h"
 #include "buffer.h"
 #include "ssid.h"
 #include "clock.h"
+#include "timeout.h"
 
 struct dl_socket_t;
 
@@ -26,41 +28,82 @@ typedef enum conn_state_t {
     STATE_AWAITING_CONNECT_2_2 = 5,
 } conn_state_t;
 
-typedef struct connection_t {
-    uint8_t port;
-    ssid_t local;
-    ssid_t remote;
+enum { STATE_COUNT = STATE_AWAITING_CONNECT_2_2 + 1 }; /* Number of states */
+
+/** The part of a connection every I and S frame touches: sequence state,
+ * flags, the send queue and the rings.  Kept together, and first in
+ * connection_t, so a busy link works out of a cache line or so.
+ */
+typedef struct conn_hot_t {
+    conn_state_t state;
     uint8_t snd_state; //< Send State V(S)
     uint8_t ack_state; //< Acknowledgement State V(A)
     uint8_t rcv_state; //< Receive State V(R)
     uint8_t window_size; //< Window size (k)
-    uint8_t rc; //< Retry Count
-    uint16_t n1; //< Maximum frame size
-    uint8_t n2; //< Maximum number of retries permitted
-    conn_state_t state;
-    version_t version;
     uint8_t modulo;
-    bool l3_initiated;
+    uint8_t ring_mask; //< Ring size - 1, see conn_set_window()
+    uint8_t rc; //< Retry Count
+    uint8_t srej_exception;
     bool self_busy;
+    bool pool_busy; //< self_busy because buffers are running low
     bool peer_busy;
     bool ack_pending;
     bool srej_enabled;
     bool rej_exception;
-    uint8_t srej_exception;
-    buffer_t *srej_queue[128];
-    packet_t *sent_buffer[128];
+    /** Rings indexed by sequence number, see conn_sent_slot() and conn_srej_slot() */
+    buffer_t **sent_buffer; //< I frames sent and not yet acknowledged
+    buffer_t **srej_queue; //< I frames received after a missing one
     buffer_t *send_queue_head;
     buffer_t *send_queue_tail;
-    duration_t srtt; //< smoothed round trip time
-    instant_t t1_expiry; //< instant when t1 will expire next, or INSTANT_ZERO if not set
-    duration_t t1_remaining; //< time remaining when t1 was last stopped.
+} conn_hot_t;
+
+typedef struct connection_t {
+    conn_hot_t hot;
+
+    /* Used for every frame: lookup and timers */
+    uint8_t port;
+    ssid_t local;
+    ssid_t remote;
+    uint16_t xmit_id; //< ACKMODE id of the last frame sent, or 0 if not waiting for the TNC.  Set with conn_set_xmit_id()
+    struct connection_t *next_active; //< Next connection on the active list, see conn_schedule()
+    bool active; //< On the active list
+    timeout_t t1;
+    timeout_t t2;
+    timeout_t t3;
     duration_t t1v; //< Next value for T1; initial value is initial value of SRT
-    duration_t t2;
-    instant_t t2_expiry;
-    instant_t t3_expiry;
+    duration_t t2v; //< Value for T2
     struct dl_socket_t *socket;
+
+    /* Used when sending, or on (re)connection and errors */
+    /** Pre-encoded address field for frames we send: [0] for responses, [1] for commands. */
+    uint8_t addrs[2][MAX_ADDRESSES * SSID_LEN];
+    uint8_t addrs_len;
+    version_t version;
+    bool l3_initiated;
+    uint16_t n1; //< Maximum frame size
+    uint8_t n2; //< Maximum number of retries permitted
+    duration_t srtt; //< smoothed round trip time
+    duration_t t1_remaining; //< time remaining when t1 was last stopped.
+    /** The rings when no others can be had: a window of one */
+    buffer_t *ring_fallback[2];
+    struct connection_t *next_free; //< Next on the free list
+    bool on_free_list;
 } connection_t;
 
+/** The frame sent as N(S) seqno, held until it's acknowledged.
+ *
+ * At most a window of frames is outstanding, so seqno can share a slot with
+ * an older frame only once that one is acknowledged.
+ */
+static inline buffer_t **conn_sent_slot(connection_t *conn, uint8_t seqno) {
+    return &conn->hot.sent_buffer[seqno & conn->hot.ring_mask];
+}
+
+/** The frame received as N(S) seqno, held until the frames before it arrive. */
+static inline buffer_t **conn_srej_slot(connection_t *conn, uint8_t seqno) {
+    return &conn->hot.srej_queue[seqno & conn->hot.ring_mask];
+}
+
 /** Returns true if low <= x < high, assuming modulo n */
 static inline bool seqno_in_range_excl(uint8_t low, uint8_t x, uint8_t high) {
     if (low <= high) {
@@ -87,8 +130,31 @@ static inline bool seqno_add(uint8_t augend, uint8_t addend, uint8_t modulo) { r
 
 connection_t *conn_find(ssid_t *local, ssid_t *remote, uint8_t port);
 connection_t *conn_find_or_create(ssid_t *local, ssid_t *remote, uint8_t port);
+/** Find the connection waiting for the TNC to acknowledge ACKMODE frame id */
+connection_t *conn_find_by_xmit_id(uint8_t port, uint16_t id);
+/** Record the ACKMODE id of the last frame sent on conn, or 0 once it's been acknowledged */
+void conn_set_xmit_id(connection_t *conn, uint16_t id);
 
-static inline conn_state_t conn_get_state(connection_t *connection) { return connection ? connection->state : STATE_DISCONNECTED; }
+static inline conn_state_t conn_get_state(connection_t *connection) { return connection ? connection->hot.state : STATE_DISCONNECTED; }
 bool conn_is_extended(connection_t *conn);
+/** Set the digipeater path frames to the remote station are sent via.
+ *
+ * via[] is the path in the order the remote station's frames arrived through
+ * it, replies go back through it in reverse.
+ */
+void conn_set_path(connection_t *conn, const ssid_t via[], size_t via_count);
 void conn_release(connection_t *connection);
+/** Set the window size (k), and size the rings to match.
+ *
+ * Any frames held in the rings are freed, so this must only be called as
+ * the link is (re)established and the sequence numbers start again.  If no
+ * memory can be had for rings that big, the window is made smaller.
+ */
+void conn_set_window(connection_t *conn, uint8_t window_size);
+/** Have the ticker send what conn has queued, or check on it while it's busy.
+ *
+ * Only connections that have been scheduled are looked at, so this must be
+ * called whenever a connection may have become able to send.
+ */
+void conn_schedule(connection_t *conn);
 #endif
@@ -0,0 +1,30 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * CRC calculations.
+ */
+#ifndef CRC_H
+#define CRC_H
+#include <stddef.h>
+#include <stdint.h>
+
+/** CRC-16 (x^16 + x^15 + x^2 + 1, bit reversed), as used by SMACK.
+ *
+ * Start with crc = 0.  Running the CRC over a frame including its (little
+ * endian) CRC gives 0.
+ */
+uint16_t crc16(uint16_t crc, const uint8_t *buf, size_t len);
+
+enum {
+    CRC_FLEX_INIT = 0xFFFF,
+    CRC_FLEX_GOOD = 0x7070,
+};
+
+/** FlexNet's KISS CRC.
+ *
+ * Start with crc = CRC_FLEX_INIT.  The CRC goes after the frame high byte
+ * first, and running the CRC over a frame including it gives CRC_FLEX_GOOD.
+ */
+uint16_t crc_flex(uint16_t crc, const uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,28 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * AX.25 control field decoding.
+ */
+#ifndef FRAME_H
+#define FRAME_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Everything in a control field, decoded. */
+typedef struct frame_desc_t {
+    uint8_t event; //< ax25_dl_event_type_t: EV_I, EV_RR, EV_UA ... or EV_UNKNOWN_FRAME
+    uint8_t len; //< Length of the control field, 1 or 2 bytes.
+    uint8_t pf; //< P/F bit
+    uint8_t nr; //< N(R), for I and S frames
+    uint8_t ns; //< N(S), for I frames
+} frame_desc_t;
+
+/** Decode the control field at the start of control[].
+ *
+ * extended selects modulo 128, where I and S frames have a two byte control
+ * field.  U frames are always one byte.  Returns false if the control field is
+ * truncated.
+ */
+bool frame_decode(const uint8_t control[], size_t len, bool extended, frame_desc_t *desc);
+#endif
@@ -0,0 +1,40 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Open addressing hash index over entries stored elsewhere.
+ */
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* An index of pointers to entries, which live in some other table.
+ *
+ * Collisions are resolved by linear probing, and removal shifts later entries
+ * back rather than leaving tombstones, so lookups don't degrade as entries
+ * come and go.  slots must have room for at least one more entry than will
+ * ever be inserted, and should be about twice that for short probe runs.
+ */
+typedef struct hash_index_t {
+    void **slots;
+    size_t size;
+    /* Hash of an entry's key, as passed to hash_index_find() */
+    uint32_t (*hash)(const void *entry);
+} hash_index_t;
+
+void hash_index_insert(hash_index_t *index, void *entry);
+/** Remove entry.  Does nothing if it isn't in the index. */
+void hash_index_remove(hash_index_t *index, void *entry);
+/** Move every entry into slots, which has room for size entries and is all
+ * NULL.  The old slots are left empty. */
+void hash_index_resize(hash_index_t *index, void **slots, size_t size);
+/** Return the first entry with this hash that match() accepts, or NULL. */
+void *hash_index_find(const hash_index_t *index, uint32_t hash,
+        bool (*match)(const void *entry, const void *key), const void *key);
+
+/* FNV-1a, for building hashes of keys */
+static const uint32_t HASH_INIT = 2166136261u;
+static inline uint32_t hash_byte(uint32_t hash, uint8_t byte) { return (hash ^ byte) * 16777619u; }
+
+#endif
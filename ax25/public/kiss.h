@@ -12,12 +12,26 @@
 /* Receive one byte */
 void kiss_recv_byte(uint8_t serial, uint8_t byte);
 
+/* Receive a block of bytes.
+ *
+ * Equivalent to calling kiss_recv_byte() for each byte, but copies runs of
+ * unescaped data in bulk.
+ */
+void kiss_recv_buffer(uint8_t serial, const uint8_t *buf, size_t len);
+
 /* Transmit one packet.
  *
  * Returns ACKMODE packet id or 0 if ackmode is not enabled for this.
  */
 uint16_t kiss_xmit(uint8_t port, uint8_t *buffer, size_t len);
 
+/* Is the link to the TNC backed up?
+ *
+ * Callers should hold off sending anything that can wait (eg queued I frames)
+ * until this returns false again.
+ */
+bool kiss_xmit_congested(uint8_t port);
+
 /* Set tx delay in units of 10ms */
 void kiss_set_txdelay(uint8_t port, uint8_t delay);
 
@@ -26,3 +40,26 @@ void kiss_set_slottime(uint8_t port, uint8_t delay);
 
 /* Set duplex */
 void kiss_set_duplex(uint8_t port, bool full_duplex);
+
+/* Enable or disable ACKMODE.
+ *
+ * With ACKMODE the TNC reports back when each frame has actually been
+ * transmitted, which is used to start T1.  The TNC must support ACKMODE.
+ */
+void kiss_set_ackmode(uint8_t port, bool enabled);
+
+/* Enable or disable SMACK (CRC protected KISS) on a serial link.
+ *
+ * When enabled, data frames are sent with a CRC, and if the TNC replies with
+ * CRC frames then frames without a valid CRC are dropped from then on.  If the
+ * TNC doesn't support SMACK, this falls back to plain KISS.
+ */
+void kiss_set_smack(uint8_t serial, bool enabled);
+
+/* Enable or disable FlexNet's CRC protected KISS on a serial link.
+ *
+ * This is negotiated the same way as SMACK, and replaces it if it was enabled.
+ * FlexNet flags CRC frames with bit 1 of the unit, so units 2, 3, 6, 7, ...
+ * are sent without a CRC.
+ */
+void kiss_set_flexnet_crc(uint8_t serial, bool enabled);
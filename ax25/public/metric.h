@@ -14,6 +14,8 @@ typedef enum metric_t {
 	METRIC_BAD_ESCAPE,
 	/* Received an unknown/unexpected kiss command byte from the TNC */
 	METRIC_UNKNOWN_KISS_COMMAND,
+	/* Received a kiss frame with a missing or incorrect CRC */
+	METRIC_KISS_BAD_CRC,
     /* Invalid address */
     METRIC_INVALID_ADDR,
     /* Number of packets received that are not for me. */
@@ -32,12 +34,6 @@ typedef enum metric_t {
     METRIC_TEST_COMMAND_SENT,
     /* Frames with R bits set to 00 or 11, used by former versions of the standard */
     METRIC_LEGACY_TYPE_RECV,
-    /* We tried to send a packet, but there were no free packet buffers available for use */
-    METRIC_NO_PACKETS,
-    /* Packets allocated */
-    METRIC_PACKETS_ALLOCATED,
-    /* Packets freed */
-    METRIC_PACKETS_FREED,
     /* Number of packets of a type that should be a command, but were instead a response */
     METRIC_NOT_COMMAND,
     /* Number of received SABM packets that were successfully set up */
@@ -46,6 +42,8 @@ typedef enum metric_t {
     METRIC_SABM_FAIL,
     /* No free connection slots */
     METRIC_NO_CONNS,
+    /* Links given a smaller window than asked for, as there was no memory for its rings */
+    METRIC_SMALL_WINDOW,
     /* Number of kiss data frames sent */
     METRIC_KISS_XMIT,
     /* Number of kiss data bytes sent */
@@ -53,6 +51,12 @@ typedef enum metric_t {
     METRIC_BUFFER_ALLOC_SUCCESS,
     METRIC_BUFFER_ALLOC_FAIL,
     METRIC_BUFFER_FREE,
+    /* Buffers allocated from each size class */
+    METRIC_BUFFER_SMALL_ALLOC,
+    METRIC_BUFFER_MEDIUM_ALLOC,
+    METRIC_BUFFER_LARGE_ALLOC,
+    /* Buffers allocated from a larger class, because the best fit was full */
+    METRIC_BUFFER_SPILL,
 	/* Not a real metric, just the last metric number, insert new metrics before here */
 	MAX_METRIC,
 } metric_t;
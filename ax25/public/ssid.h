@@ -6,16 +6,22 @@
 #ifndef SSID_H
 #define SSID_H 1
 #include "config.h"
-#include "packet.h"
 #include <stdint.h>
 #include <stdbool.h>
 
 enum {
     SSID_LEN = 7,
+    /* SSID of a listener that accepts connections to any SSID of its callsign */
+    SSID_WILDCARD = 0x7F,
 };
 
 typedef struct ssid_t {
-    char ssid[SSID_LEN];
+    union {
+        char ssid[SSID_LEN];
+        /* The whole ssid as one integer, so it can be compared and hashed in
+         * one go.  The byte after ssid[] is always 0. */
+        uint64_t packed;
+    };
 } ssid_t;
 
 /** parse an ssid from a string */
@@ -24,9 +30,15 @@ bool ssid_from_string(const char *str, ssid_t *ssid);
 bool ssid_parse(const uint8_t buffer[static SSID_LEN], ssid_t *ssid);
 /** output an ssid to the debug port */
 void ssid_debug(const ssid_t *ssid);
-/** write an ssid to a packet in ax.25 packet format. */
-bool ssid_push(packet_t *packet, const ssid_t *ssid);
-bool ssid_cmp(const ssid_t *lhs, const ssid_t *rhs);
+/** encode an ssid in ax.25 packet format, with the C/H and end bits clear. */
+void ssid_encode(const ssid_t *ssid, uint8_t buffer[static SSID_LEN]);
+/** Returns 0 if lhs and rhs are the same ssid */
+static inline bool ssid_cmp(const ssid_t *lhs, const ssid_t *rhs) { return lhs->packed != rhs->packed; }
+/** Fold an ssid into a hash (see hash_index.h) */
+static inline uint32_t ssid_hash(uint32_t hash, const ssid_t *ssid) {
+    /* Multiplicative hashing, the top bits are the well mixed ones */
+    return ((hash ^ ssid->packed) * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+}
 
 struct format_t format_ssid(ssid_t *ssid);
 #define FMT_SSID(ssid) format_ssid(ssid)
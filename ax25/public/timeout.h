@@ -0,0 +1,46 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Timeouts, kept in a min-heap ordered by expiry.
+ */
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+#include <stdbool.h>
+#include <stddef.h>
+#include "clock.h"
+
+typedef struct timeout_t {
+    instant_t expiry; //< When this expires, or INSTANT_ZERO if not running
+    size_t index; //< Position in the heap while running
+    void (*expire)(struct timeout_t *timeout);
+    void *userdata;
+} timeout_t;
+
+/** Set up a timeout.  Stops it first if it was running. */
+void timeout_init(timeout_t *timeout, void (*expire)(timeout_t *timeout), void *userdata);
+
+/** (Re)start a timeout, to expire at expiry.  expiry must not be INSTANT_ZERO. */
+void timeout_start(timeout_t *timeout, instant_t expiry);
+
+/** Stop a timeout.  Does nothing if it isn't running. */
+void timeout_stop(timeout_t *timeout);
+
+static inline bool timeout_running(const timeout_t *timeout) {
+    return instant_cmp(timeout->expiry, INSTANT_ZERO) != 0;
+}
+
+/** Make room for count timeouts to be running at once.
+ *
+ * There's room for MAX_TIMEOUTS to start with.  Returns false if it can't
+ * grow that far.
+ */
+bool timeout_reserve(size_t count);
+
+/** Expire every timeout that is due.
+ *
+ * Costs O(log n) per expired timeout.  Returns how long until the next
+ * timeout is due.
+ */
+duration_t timeout_run(void);
+
+#endif
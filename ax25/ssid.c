@@ -15,6 +15,20 @@ static const ssid_t empty_ssid = {
     .ssid = { ' ', ' ', ' ', ' ', ' ', ' ', '\x00' },
 };
 
+/* Masks over the 8 bytes of an on-air address field (plus one byte of
+ * padding), as bytes so that they work in either endianness once memcpy'd
+ * into a uint64_t. */
+static const uint8_t addr_low_bits[sizeof(uint64_t)] = { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00 };
+static const uint8_t addr_decoded[sizeof(uint64_t)] = { 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x0F, 0x00 };
+static const uint8_t addr_encoded[sizeof(uint64_t)] = { 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0x00 };
+static const uint8_t addr_encoded_flags[sizeof(uint64_t)] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x00 };
+
+static uint64_t load_mask(const uint8_t mask[static sizeof(uint64_t)]) {
+    uint64_t value;
+    memcpy(&value, mask, sizeof(value));
+    return value;
+}
+
 bool ssid_from_string(const char *str, ssid_t *ssid) {
     *ssid = empty_ssid;
 
@@ -22,7 +36,7 @@ bool ssid_from_string(const char *str, ssid_t *ssid) {
     for(i = 0; i < SSID_LEN-1; ++i) {
         switch (str[i]) {
             case '-':
-                ssid->ssid[SSID_LEN-1] = str[i+1] - '0';
+                ssid->ssid[SSID_LEN-1] = str[i+1] == '*' ? SSID_WILDCARD : str[i+1] - '0';
                 /* fall through */
             case '\0':
                 /* pad string with NULs */
@@ -41,36 +55,26 @@ bool ssid_from_string(const char *str, ssid_t *ssid) {
         }
     }
     if (str[i] == '-') {
-        ssid->ssid[SSID_LEN-1] = str[i+1] - '0';
+        ssid->ssid[SSID_LEN-1] = str[i+1] == '*' ? SSID_WILDCARD : str[i+1] - '0';
     }
     return true;
 }
 
 bool ssid_parse(const uint8_t buffer[static SSID_LEN], ssid_t *ssid) {
-    /* Verify all the low bits are 0, but ignore the low bit of the ssid */
-    if (((buffer[0] | buffer[1] | buffer[2] | buffer[3] | buffer[4] | buffer[5]) & 0x01) != 0x00)
-        return false;
-
-    for(size_t i=0; i < SSID_LEN-1; ++i) {
-        ssid->ssid[i] = buffer[i] >> 1;
-    }
-
-    ssid->ssid[SSID_LEN-1] = (buffer[SSID_LEN-1] & 0b00011110) >> 1;
+    /* Decode all 7 bytes at once: shifting the whole word right by one moves
+     * a bit from each byte into its neighbour, but those are exactly the bits
+     * the mask throws away. */
+    uint64_t raw = 0;
+    memcpy(&raw, buffer, SSID_LEN);
+    ssid->packed = (raw >> 1) & load_mask(addr_decoded);
 
-    return true;
-}
-
-bool ssid_push(packet_t *packet, const ssid_t *ssid) {
-    for(size_t i=0; i<SSID_LEN-1; ++i) {
-        packet_push_byte(packet, ssid->ssid[i] << 1);
-    }
-    packet_push_byte(packet, (ssid->ssid[SSID_LEN-1] << 1) | 0b01100000);
-
-    return false;
+    /* Verify all the low bits are 0, but ignore the low bit of the ssid */
+    return (raw & load_mask(addr_low_bits)) == 0;
 }
 
-bool ssid_cmp(const ssid_t *lhs, const ssid_t *rhs) {
-    return memcmp(lhs->ssid, rhs->ssid, sizeof(lhs->ssid));
+void ssid_encode(const ssid_t *ssid, uint8_t buffer[static SSID_LEN]) {
+    uint64_t encoded = ((ssid->packed << 1) & load_mask(addr_encoded)) | load_mask(addr_encoded_flags);
+    memcpy(buffer, &encoded, SSID_LEN);
 }
 
 static bool format_internal_ssid(char **buffer, size_t *buffer_len, struct format_t *self) {
@@ -82,7 +86,10 @@ static bool format_internal_ssid(char **buffer, size_t *buffer_len, struct forma
         else
             break;
     }
-    if (ssid->ssid[SSID_LEN-1] != '\0') {
+    if (ssid->ssid[SSID_LEN-1] == SSID_WILDCARD) {
+        RETURN_IF_FALSE(format_putch(buffer, buffer_len, '-'));
+        RETURN_IF_FALSE(format_putch(buffer, buffer_len, '*'));
+    } else if (ssid->ssid[SSID_LEN-1] != '\0') {
         RETURN_IF_FALSE(format_putch(buffer, buffer_len, '-'));
         RETURN_IF_FALSE(format_putch(buffer, buffer_len, ssid->ssid[SSID_LEN-1] + '0'));
     }
@@ -0,0 +1,121 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Timeouts, kept in a min-heap ordered by expiry.
+ *
+ * Starting, stopping and expiring a timeout are all O(log n), and the next
+ * deadline is always at the root.
+ */
+#include "timeout.h"
+#include "config.h"
+#include "debug.h"
+#include "platform.h"
+#include <string.h> // for memcpy
+
+static timeout_t *static_heap[MAX_TIMEOUTS];
+static timeout_t **heap = static_heap;
+static size_t heap_size = MAX_TIMEOUTS;
+static size_t heap_len = 0;
+
+static bool heap_before(size_t a, size_t b) {
+    return instant_cmp(heap[a]->expiry, heap[b]->expiry) < 0;
+}
+
+static void heap_swap(size_t a, size_t b) {
+    timeout_t *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->index = a;
+    heap[b]->index = b;
+}
+
+static void heap_sift_up(size_t i) {
+    while (i > 0 && heap_before(i, (i - 1) / 2)) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_sift_down(size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1;
+        size_t right = 2 * i + 2;
+        if (left < heap_len && heap_before(left, smallest))
+            smallest = left;
+        if (right < heap_len && heap_before(right, smallest))
+            smallest = right;
+        if (smallest == i)
+            return;
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_remove(size_t i) {
+    heap_len--;
+    if (i != heap_len) {
+        heap[i] = heap[heap_len];
+        heap[i]->index = i;
+        /* The moved timeout could belong either side of where it landed */
+        heap_sift_up(i);
+        heap_sift_down(heap[i]->index);
+    }
+}
+
+void timeout_init(timeout_t *timeout, void (*expire)(timeout_t *timeout), void *userdata) {
+    timeout_stop(timeout);
+    timeout->expire = expire;
+    timeout->userdata = userdata;
+}
+
+void timeout_start(timeout_t *timeout, instant_t expiry) {
+    CHECK(instant_cmp(expiry, INSTANT_ZERO) != 0);
+    if (timeout_running(timeout)) {
+        timeout->expiry = expiry;
+        heap_sift_up(timeout->index);
+        heap_sift_down(timeout->index);
+        return;
+    }
+    CHECK(heap_len < heap_size);
+    timeout->expiry = expiry;
+    timeout->index = heap_len;
+    heap[heap_len++] = timeout;
+    heap_sift_up(timeout->index);
+}
+
+void timeout_stop(timeout_t *timeout) {
+    if (!timeout_running(timeout))
+        return;
+    CHECK(heap[timeout->index] == timeout);
+    heap_remove(timeout->index);
+    timeout->expiry = INSTANT_ZERO;
+}
+
+bool timeout_reserve(size_t count) {
+    if (count <= heap_size)
+        return true;
+    timeout_t **grown = platform_alloc(count * sizeof(*grown));
+    if (!grown)
+        return false;
+    memcpy(grown, heap, heap_len * sizeof(*grown));
+    if (heap != static_heap)
+        platform_free(heap);
+    heap = grown;
+    heap_size = count;
+    return true;
+}
+
+duration_t timeout_run(void) {
+    instant_t now = instant_now();
+    while (heap_len > 0 && instant_cmp(heap[0]->expiry, now) <= 0) {
+        timeout_t *timeout = heap[0];
+        heap_remove(0);
+        timeout->expiry = INSTANT_ZERO;
+        /* May start or stop any timeout, including this one */
+        timeout->expire(timeout);
+    }
+    if (heap_len == 0)
+        return duration_seconds(3600);
+    return instant_sub(heap[0]->expiry, now);
+}
@@ -0,0 +1,88 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * epoll() based event loop backend.
+ *
+ * fds are registered once, edge triggered, with write interest registered up
+ * front, so a wakeup costs O(ready fds) rather than O(registered fds).
+ */
+#define _GNU_SOURCE
+#include "platform-posix.h"
+#include "clock.h"
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h>
+
+enum { MAX_EPOLL_EVENTS = 32 };
+
+static int epoll_fd = -1;
+
+static int get_epoll_fd(void) {
+    if (epoll_fd == -1) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1)
+            panic("epoll_create1");
+    }
+    return epoll_fd;
+}
+
+void register_fd_event(fd_event_t *event) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET | (event->write_callback ? EPOLLOUT : 0),
+        .data.ptr = event,
+    };
+    if (epoll_ctl(get_epoll_fd(), EPOLL_CTL_ADD, event->fd, &ev) == -1)
+        panic("epoll_ctl(EPOLL_CTL_ADD)");
+}
+
+void unregister_fd_event(fd_event_t *event) {
+    if (event->fd >= 0)
+        epoll_ctl(get_epoll_fd(), EPOLL_CTL_DEL, event->fd, NULL);
+    event->fd = -1;
+    event->want_write = false;
+}
+
+void fd_event_set_want_write(fd_event_t *event, bool want_write) {
+    event->want_write = want_write;
+}
+
+void platform_pwrite_async(int fd, const void *buf, size_t len, off_t offset) {
+    /* No asynchronous IO here, just write it now */
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        buf = (const uint8_t *)buf + ret;
+        len -= ret;
+        offset += ret;
+    }
+}
+
+void platform_wait_fds(duration_t timeout) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    /* Round up, so we don't wake early and spin until a timer expires */
+    int64_t wait_ms = (duration_as_micros(timeout) + 999) / 1000;
+    if (wait_ms < 0)
+        wait_ms = 0;
+
+    int count = epoll_wait(get_epoll_fd(), events, MAX_EPOLL_EVENTS, wait_ms);
+    if (count == -1) {
+        if (errno != EINTR)
+            panic("epoll_wait");
+        return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        fd_event_t *event = events[i].data.ptr;
+        /* An earlier callback in this batch may have unregistered this event,
+         * so check fd before every dispatch. */
+        if (event->fd >= 0 && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            event->callback(event);
+        }
+        if (event->fd >= 0 && event->want_write && events[i].events & EPOLLOUT) {
+            event->write_callback(event);
+        }
+    }
+}
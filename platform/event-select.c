@@ -0,0 +1,92 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * select() based event loop backend.
+ *
+ * Portable, but O(n) in the number of registered fds per wakeup, and limited
+ * to FD_SETSIZE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "platform-posix.h"
+#include "clock.h"
+#include <sys/select.h>
+#include <errno.h>
+#include <unistd.h>
+
+static fd_event_t *fd_events = NULL;
+
+void register_fd_event(fd_event_t *event) {
+    event->next = fd_events;
+    fd_events = event;
+}
+
+void unregister_fd_event(fd_event_t *event) {
+    for(fd_event_t **it = &fd_events; *it; it = &(*it)->next) {
+        if (*it == event) {
+            *it = event->next;
+            break;
+        }
+    }
+    event->fd = -1;
+    event->want_write = false;
+}
+
+static int platform_get_fds(fd_set *rfds, fd_set *wfds) {
+    int maxfd = 0;
+    FD_ZERO(rfds);
+    FD_ZERO(wfds);
+    for(fd_event_t *event = fd_events; event; event=event->next) {
+        FD_SET(event->fd, rfds);
+        if (event->want_write && event->write_callback)
+            FD_SET(event->fd, wfds);
+        if (event->fd > maxfd)
+            maxfd = event->fd;
+    }
+    return maxfd;
+}
+
+static void platform_run_fds(fd_set *rfds, fd_set *wfds) {
+    fd_event_t *next;
+    for(fd_event_t *event = fd_events; event; event=next) {
+        /* Callbacks may unregister their own event */
+        next = event->next;
+        if (event->fd >= 0 && FD_ISSET(event->fd, rfds)) {
+            event->callback(event);
+        }
+        if (event->fd >= 0 && event->want_write && FD_ISSET(event->fd, wfds)) {
+            event->write_callback(event);
+        }
+    }
+}
+
+void fd_event_set_want_write(fd_event_t *event, bool want_write) {
+    event->want_write = want_write;
+}
+
+void platform_pwrite_async(int fd, const void *buf, size_t len, off_t offset) {
+    /* No asynchronous IO here, just write it now */
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        buf = (const uint8_t *)buf + ret;
+        len -= ret;
+        offset += ret;
+    }
+}
+
+void platform_wait_fds(duration_t timeout) {
+    fd_set rfds, wfds;
+    int maxfd = platform_get_fds(&rfds, &wfds);
+    int64_t wait_us = duration_as_micros(timeout);
+    if (wait_us < 0)
+        wait_us = 0;
+    struct timeval tv = { .tv_sec = wait_us / 1000000, .tv_usec = wait_us % 1000000 };
+    if (select(maxfd+1, &rfds, &wfds, NULL, &tv) == -1) {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+    }
+    platform_run_fds(&rfds, &wfds);
+}
@@ -0,0 +1,365 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * io_uring based event loop backend (Linux 5.11+).
+ *
+ * Readiness is watched with multishot polls that stay armed across wakeups,
+ * write interest is a oneshot poll armed only while wanted, and file appends
+ * (the pcap) are copied into registered buffers and written asynchronously.
+ * Everything queued during one pass of the loop is submitted in the same
+ * io_uring_enter() that waits for the next events, so a busy loop costs one
+ * syscall per wakeup for the ring itself.
+ *
+ * Talks to the kernel directly rather than via liburing, to avoid the
+ * dependency.
+ */
+#define _GNU_SOURCE
+#include "platform-posix.h"
+#include "clock.h"
+#include "debug.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+    URING_ENTRIES = 64,
+    MAX_URING_FDS = 64,
+    MAX_URING_WRITES = 8,
+    URING_WRITE_SIZE = 4096,
+    /* CQEs that arrive while waiting for a write buffer are kept for later,
+     * at most one per poll */
+    MAX_DEFERRED = 2 * MAX_URING_FDS,
+};
+
+/* user_data is (generation << 32) | (slot << 2) | kind */
+enum {
+    KIND_READ = 0,
+    KIND_WRITE = 1,
+    KIND_PWRITE = 2,
+    KIND_CANCEL = 3,
+};
+
+static struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    /* SQEs queued but not yet handed to the kernel */
+    unsigned pending;
+} ring = { .fd = -1 };
+
+static struct {
+    fd_event_t *event;
+    uint32_t generation;
+    bool write_armed;
+} regs[MAX_URING_FDS];
+
+static bool multishot = true;
+
+static uint8_t write_buf[MAX_URING_WRITES][URING_WRITE_SIZE];
+static bool write_busy[MAX_URING_WRITES];
+static bool write_buf_registered = false;
+
+/* Our copy of a CQE (the kernel's has a flexible array member) */
+typedef struct completion_t {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+} completion_t;
+
+static completion_t deferred[MAX_DEFERRED];
+static size_t deferred_count = 0;
+/* Deferred entries before this have already been completed */
+static size_t deferred_done = 0;
+
+static uint64_t user_data(size_t slot, unsigned kind) {
+    return (uint64_t)regs[slot].generation << 32 | slot << 2 | kind;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    int ret = syscall(SYS_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, argsz);
+    if (ret > 0)
+        ring.pending -= ret;
+    return ret;
+}
+
+static void uring_init(void) {
+    if (ring.fd != -1)
+        return;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd == -1)
+        panic("io_uring_setup");
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+        panic("io_uring too old");
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    uint8_t *rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED)
+        panic("io_uring mmap");
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        panic("io_uring mmap");
+
+    ring.entries = p.sq_entries;
+    ring.sq_head = (unsigned *)(rings + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(rings + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(rings + p.sq_off.array);
+    ring.cq_head = (unsigned *)(rings + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(rings + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+    /* Registered buffers save the kernel mapping the pages on every write.
+     * This can fail with a low RLIMIT_MEMLOCK, in which case we use the same
+     * buffers unregistered. */
+    struct iovec iov[MAX_URING_WRITES];
+    for (size_t i = 0; i < MAX_URING_WRITES; ++i)
+        iov[i] = (struct iovec) { .iov_base = write_buf[i], .iov_len = URING_WRITE_SIZE };
+    write_buf_registered = syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, MAX_URING_WRITES) == 0;
+}
+
+static void uring_push(const struct io_uring_sqe *sqe) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries) {
+        /* Full, hand what we have to the kernel to make room */
+        if (uring_enter(ring.pending, 0, 0, NULL, 0) == -1 && errno != EINTR && errno != EBUSY)
+            panic("io_uring_enter");
+    }
+    unsigned index = tail & *ring.sq_mask;
+    ring.sqes[index] = *sqe;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+}
+
+static void uring_poll(size_t slot, unsigned kind, uint32_t events, bool multi) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_POLL_ADD,
+        .fd = regs[slot].event->fd,
+        .len = multi ? IORING_POLL_ADD_MULTI : 0,
+        .poll32_events = events,
+        .user_data = user_data(slot, kind),
+    };
+    uring_push(&sqe);
+}
+
+static void uring_poll_remove(size_t slot, unsigned kind) {
+    struct io_uring_sqe sqe = {
+        .opcode = IORING_OP_POLL_REMOVE,
+        .fd = -1,
+        .addr = user_data(slot, kind),
+        .user_data = KIND_CANCEL,
+    };
+    uring_push(&sqe);
+}
+
+void register_fd_event(fd_event_t *event) {
+    uring_init();
+    for (size_t slot = 0; slot < MAX_URING_FDS; ++slot) {
+        if (!regs[slot].event) {
+            /* A new generation, so completions for whoever had this slot
+             * before are recognised as stale. */
+            regs[slot].generation++;
+            regs[slot].event = event;
+            regs[slot].write_armed = false;
+            event->backend_id = slot;
+            uring_poll(slot, KIND_READ, POLLIN, multishot);
+            if (event->want_write)
+                fd_event_set_want_write(event, true);
+            return;
+        }
+    }
+    panic("Too many fds for io_uring");
+}
+
+void unregister_fd_event(fd_event_t *event) {
+    size_t slot = event->backend_id;
+    if (event->fd >= 0 && slot < MAX_URING_FDS && regs[slot].event == event) {
+        uring_poll_remove(slot, KIND_READ);
+        if (regs[slot].write_armed)
+            uring_poll_remove(slot, KIND_WRITE);
+        /* Submit now, the caller is about to close the fd and the ring holds
+         * a reference to it until the polls are gone. */
+        uring_enter(ring.pending, 0, 0, NULL, 0);
+        regs[slot].event = NULL;
+    }
+    event->fd = -1;
+    event->want_write = false;
+}
+
+void fd_event_set_want_write(fd_event_t *event, bool want_write) {
+    event->want_write = want_write;
+    size_t slot = event->backend_id;
+    if (want_write && event->fd >= 0 && slot < MAX_URING_FDS && regs[slot].event == event && !regs[slot].write_armed) {
+        regs[slot].write_armed = true;
+        uring_poll(slot, KIND_WRITE, POLLOUT, false);
+    }
+}
+
+static void uring_complete(const completion_t *cqe) {
+    unsigned kind = cqe->user_data & 3;
+    size_t slot = (cqe->user_data & 0xFFFFFFFF) >> 2;
+    uint32_t generation = cqe->user_data >> 32;
+
+    if (kind == KIND_CANCEL)
+        return;
+
+    if (kind == KIND_PWRITE) {
+        write_busy[slot] = false;
+        if (cqe->res < 0)
+            DEBUG(STR("io_uring write failed: "), INT(-cqe->res));
+        return;
+    }
+
+    fd_event_t *event = regs[slot].event;
+    if (!event || regs[slot].generation != generation)
+        return; /* Unregistered since this was queued */
+
+    if (kind == KIND_READ) {
+        if (cqe->res == -EINVAL && multishot) {
+            /* Kernel doesn't do multishot polls, fall back to rearming */
+            multishot = false;
+            uring_poll(slot, KIND_READ, POLLIN, false);
+            return;
+        }
+        if (cqe->res < 0) {
+            /* Don't leave the fd unwatched, or it goes quiet for good */
+            DEBUG(STR("io_uring poll failed: "), INT(-cqe->res));
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                uring_poll(slot, KIND_READ, POLLIN, multishot);
+            return;
+        }
+        event->callback(event);
+        /* Oneshot polls, and multishot polls the kernel gave up on, need
+         * rearming if the callback didn't unregister. */
+        if (!(cqe->flags & IORING_CQE_F_MORE) && regs[slot].event == event && regs[slot].generation == generation)
+            uring_poll(slot, KIND_READ, POLLIN, multishot);
+    } else {
+        regs[slot].write_armed = false;
+        if (event->want_write && cqe->res >= 0)
+            event->write_callback(event);
+        /* Still more to write? */
+        if (regs[slot].event == event && regs[slot].generation == generation && event->want_write)
+            fd_event_set_want_write(event, true);
+    }
+}
+
+/* Take the next completion off the ring, or return false if it's empty. */
+static bool uring_reap(completion_t *cqe) {
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    const struct io_uring_cqe *entry = &ring.cqes[head & *ring.cq_mask];
+    *cqe = (completion_t) { .user_data = entry->user_data, .res = entry->res, .flags = entry->flags };
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Keep a completion until we're back in platform_wait_fds().
+ *
+ * A multishot poll can complete many times while we wait, but its callback
+ * only needs running once, so later completions replace the one still
+ * waiting.  That keeps the latest flags, so a poll the kernel gave up on is
+ * still rearmed.
+ */
+static void uring_defer(const completion_t *cqe) {
+    if ((cqe->user_data & 3) == KIND_CANCEL)
+        return;
+    for (size_t i = deferred_done; i < deferred_count; ++i) {
+        if (deferred[i].user_data == cqe->user_data) {
+            deferred[i] = *cqe;
+            return;
+        }
+    }
+    if (deferred_count >= MAX_DEFERRED)
+        panic("io_uring deferred completions overflow");
+    deferred[deferred_count++] = *cqe;
+}
+
+/* Find a free write buffer, waiting for an earlier write to complete if
+ * necessary.  Anything else that completes meanwhile is deferred, as we may be
+ * deep inside some other callback.
+ */
+static size_t uring_write_slot(void) {
+    for (;;) {
+        for (size_t i = 0; i < MAX_URING_WRITES; ++i) {
+            if (!write_busy[i])
+                return i;
+        }
+        if (uring_enter(ring.pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+            panic("io_uring_enter");
+        completion_t cqe;
+        while (uring_reap(&cqe)) {
+            if ((cqe.user_data & 3) == KIND_PWRITE)
+                uring_complete(&cqe);
+            else
+                uring_defer(&cqe);
+        }
+    }
+}
+
+void platform_pwrite_async(int fd, const void *buf, size_t len, off_t offset) {
+    uring_init();
+    while (len > 0) {
+        size_t chunk = len < URING_WRITE_SIZE ? len : URING_WRITE_SIZE;
+        size_t slot = uring_write_slot();
+        memcpy(write_buf[slot], buf, chunk);
+        write_busy[slot] = true;
+        struct io_uring_sqe sqe = {
+            .opcode = write_buf_registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+            .fd = fd,
+            .off = offset,
+            .addr = (uintptr_t) write_buf[slot],
+            .len = chunk,
+            .buf_index = write_buf_registered ? slot : 0,
+            .user_data = slot << 2 | KIND_PWRITE,
+        };
+        uring_push(&sqe);
+        buf = (const uint8_t *)buf + chunk;
+        len -= chunk;
+        offset += chunk;
+    }
+}
+
+void platform_wait_fds(duration_t timeout) {
+    uring_init();
+
+    if (deferred_count == 0) {
+        int64_t wait_us = duration_as_micros(timeout);
+        if (wait_us < 0)
+            wait_us = 0;
+        struct __kernel_timespec ts = { .tv_sec = wait_us / 1000000, .tv_nsec = wait_us % 1000000 * 1000 };
+        struct io_uring_getevents_arg arg = {
+            .sigmask = 0,
+            .sigmask_sz = _NSIG / 8,
+            .ts = (uintptr_t) &ts,
+        };
+        if (uring_enter(ring.pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1
+                && errno != EINTR && errno != ETIME && errno != EBUSY)
+            panic("io_uring_enter");
+    }
+
+    /* Callbacks can append to deferred, so walk it by index */
+    while (deferred_done < deferred_count)
+        uring_complete(&deferred[deferred_done++]);
+    deferred_count = 0;
+    deferred_done = 0;
+
+    completion_t cqe;
+    while (uring_reap(&cqe))
+        uring_complete(&cqe);
+}
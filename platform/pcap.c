@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 enum {
@@ -47,9 +48,29 @@ enum {
 };
 
 static int posix_fd = -1;
+static off_t pcap_offset = 0;
+
+/* Blocks are assembled here and written with a single call */
+static uint8_t pcap_buf[4096];
+static size_t pcap_len = 0;
+
+static void pcap_flush(void) {
+    platform_pwrite_async(posix_fd, pcap_buf, pcap_len, pcap_offset);
+    pcap_offset += pcap_len;
+    pcap_len = 0;
+}
 
 static void pcap_write(const void *data, size_t datalen) {
-    write(posix_fd, data, datalen);
+    const uint8_t *ptr = data;
+    while (datalen > 0) {
+        if (pcap_len == sizeof(pcap_buf))
+            pcap_flush();
+        size_t chunk = sizeof(pcap_buf) - pcap_len < datalen ? sizeof(pcap_buf) - pcap_len : datalen;
+        memcpy(&pcap_buf[pcap_len], ptr, chunk);
+        pcap_len += chunk;
+        ptr += chunk;
+        datalen -= chunk;
+    }
 }
 
 static void pcap_write_padded(const void *data, size_t datalen) {
@@ -141,6 +162,7 @@ static void pcap_write_epb(capture_dir_t dir, const uint8_t data[], size_t datal
     }
     pcap_write_option(PCAP_OPT_END, NULL, 0);
     pcap_write_u32(EPB_BASE_LEN * sizeof(uint32_t) + round_to_u32(datalen));
+    pcap_flush();
 }
 
 static capture_t pcap_capture = {
@@ -155,5 +177,6 @@ void pcap_init(void) {
 
     pcap_write_shb();
     pcap_write_idb();
+    pcap_flush();
     capture_register(&pcap_capture);
 }
@@ -29,6 +29,17 @@ void panic(const char *msg) {
     abort();
 }
 
+void *platform_alloc(size_t size) {
+    (void) size;
+    /* Only the statically sized tables are used */
+    return NULL;
+}
+
+void platform_free(void *ptr) {
+    (void) ptr;
+    /* Nothing is ever allocated */
+}
+
 void register_ticker(ticker_t *ticker) {
     /* For the null platform we don't register (nor run) tickers, but for a
      * functional system tickers registered with this should all be called
@@ -41,10 +52,19 @@ void platform_init(int argc, char *argv[]) {
     /* Nothing to do by default */
 }
 
+static bool woken = false;
+
+void platform_wakeup(void) {
+    /* platform_run() should check this before sleeping, and clear it before
+     * calling the tickers. */
+    woken = true;
+}
+
 void platform_run(void) {
     /* This function should call ticker's occasionally, and call
      * `void * serial_recv_byte(uint8_t serialport, uint8_t byte);` when a byte
-     * is received on a serialport.  serialport numbers are 0..15.
+     * is received on a serialport, or `serial_recv_bytes()` with a block of
+     * bytes.  serialport numbers are 0..15.
      *
      * This function is expected to not exit.
      */
@@ -8,24 +8,18 @@
 #include "platform-posix.h"
 #include "debug.h"
 #include "clock.h"
-#include <sys/select.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
 static ticker_t *tickers = NULL;
-static fd_event_t *fd_events = NULL;
+static bool woken = false;
 
 void register_ticker(ticker_t *ticker) {
     ticker->next = tickers;
     tickers = ticker;
 }
 
-void register_fd_event(fd_event_t *event) {
-    event->next = fd_events;
-    fd_events = event;
-}
-
 instant_t instant_now(void) {
     struct timespec ts;
     if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
@@ -38,6 +32,14 @@ instant_t instant_now(void) {
                 duration_nanos(ts.tv_nsec)));
 }
 
+void *platform_alloc(size_t size) {
+    return calloc(1, size);
+}
+
+void platform_free(void *ptr) {
+    free(ptr);
+}
+
 void panic(const char *msg) {
     DEBUG(STR(msg));
     abort();
@@ -52,38 +54,20 @@ static duration_t platform_run_tickers(void) {
     return wait;
 }
 
-static fd_set platform_get_fds(int *maxfd) {
-    fd_set fds;
-    *maxfd = 0;
-    FD_ZERO(&fds);
-    for(fd_event_t *event = fd_events; event; event=event->next) {
-        FD_SET(event->fd, &fds);
-        if (event->fd > *maxfd)
-            *maxfd = event->fd;
-    }
-    return fds;
-}
-
-static void platform_run_fds(fd_set *fds) {
-    for(fd_event_t *event = fd_events; event; event=event->next) {
-        if (FD_ISSET(event->fd, fds)) {
-            event->callback();
-        }
-    }
+/* Everything runs on the event loop, so wakeups only ever come from fd
+ * callbacks or the tickers themselves, and a flag is all that's needed.
+ */
+void platform_wakeup(void) {
+    woken = true;
 }
 
 void platform_run(void) {
-    duration_t wait;
     for (;;) {
-        int maxfd;
-        fd_set rfd = platform_get_fds(&maxfd);
-        wait = platform_run_tickers();
-        int64_t wait_us = duration_as_micros(wait);
-        struct timeval timeout = { .tv_sec = wait_us / 1000000, .tv_usec = wait_us % 1000000 };
-        select(maxfd+1, &rfd, NULL, NULL, &timeout);
-        platform_run_fds(&rfd);
+        woken = false;
+        duration_t wait = platform_run_tickers();
+        /* Work was queued for a ticker that had already run */
+        platform_wait_fds(woken ? DURATION_ZERO : wait);
     }
-
 }
 
 void platform_init(int argc, char *argv[]) {
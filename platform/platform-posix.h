@@ -6,19 +6,75 @@
 #ifndef PLATFORM_POSIX_H
 #define PLATFORM_POSIX_H
 #include "platform.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
+/* An fd watched by the event loop.
+ *
+ * The event loop backend may be edge triggered, so fds should be non-blocking
+ * and callbacks must consume everything available (until EAGAIN) before
+ * returning.
+ */
 typedef struct fd_event_t {
     struct fd_event_t *next;
     int fd;
-    void (*callback)(void);
+    /* Called when fd is readable, or has hung up */
+    void (*callback)(struct fd_event_t *event);
+    /* Called when fd becomes writable, only while want_write is set.  Output
+     * should be written directly first, as this only fires after a write has
+     * returned EAGAIN.
+     */
+    void (*write_callback)(struct fd_event_t *event);
+    /* Only change with fd_event_set_want_write() */
+    bool want_write;
+    void *userdata;
+    /* Private to the event loop backend */
+    uint32_t backend_id;
 } fd_event_t;
 
-/* Register a function to be called when a FD has a read event */
+/* Register a function to be called when a FD has a read event.
+ *
+ * write_callback must be set before registering if it is ever going to be
+ * used.
+ */
 void register_fd_event(fd_event_t *event);
 
+/* Stop watching a FD.  Must be called before the fd is closed.  Safe to call
+ * from the event's own callback.
+ */
+void unregister_fd_event(fd_event_t *event);
+
+/* Start or stop calling write_callback when the fd is writable. */
+void fd_event_set_want_write(fd_event_t *event, bool want_write);
+
+/* Write to a regular file at offset, without waiting for it to complete.
+ *
+ * buf is copied, and may be reused as soon as this returns.  Writes may
+ * complete in any order, hence the explicit offset.
+ */
+void platform_pwrite_async(int fd, const void *buf, size_t len, off_t offset);
+
+/* Wait until timeout for events on registered FDs, and dispatch them.
+ *
+ * Provided by the event loop backend selected at build time (event-select.c
+ * or event-epoll.c).
+ */
+void platform_wait_fds(duration_t timeout);
+
+/* Serial devices that are not a local tty (eg KISS over TCP) supply their
+ * own output function.
+ */
+void register_serial_output(uint8_t device, void (*write)(uint8_t device, const uint8_t *buf, size_t len));
+
+/* Report how much output is queued for a device, out of size, to drive
+ * serial_tx_congested().
+ */
+void serial_output_queued(uint8_t device, size_t queued, size_t size);
+
 void serial_init(int argc, char *argv[]);
 
 void pcap_init(void);
 
 #endif
-
@@ -5,6 +5,7 @@
  */
 #ifndef PLATFORM_H
 #define PLATFORM_H
+#include <stddef.h>
 #include <stdint.h>
 #include <stdnoreturn.h>
 #include "clock.h"
@@ -26,6 +27,17 @@ void platform_init(int argc, char *argv[]);
 /* Runs the program, calling back for configured events. */
 void platform_run(void);
 
+/* Run the tickers again as soon as possible, because there's new work for
+ * them that they didn't know about when they last returned. */
+void platform_wakeup(void);
+
+/* Allocate size bytes of zeroed memory, to grow tables past their static
+ * size.  Returns NULL if the platform can't (or has no heap at all). */
+void *platform_alloc(size_t size);
+
+/* Release memory from platform_alloc() */
+void platform_free(void *ptr);
+
 /* Crash the program with a message */
 noreturn void panic(const char *msg);
 
@@ -5,10 +5,27 @@
  */
 #ifndef SERIAL_H
 #define SERIAL_H
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 void serial_putch(uint8_t serial, uint8_t data);
-void register_serial(uint8_t device, void (*rx)(uint8_t device, uint8_t ch), bool debug);
+/** Write a block of bytes to a serial device as a single operation. */
+void serial_write(uint8_t serial, const uint8_t *buf, size_t len);
+/** Is output backing up on a serial device?
+ *
+ * Becomes true once the output queue passes its high watermark (3/4 full),
+ * and stays true until it drains below the low watermark (1/4 full).  While
+ * congested, the protocol layer should stop draining its send queues, as
+ * writes that don't fit in the queue are dropped.
+ */
+bool serial_tx_congested(uint8_t serial);
+/** Attach a protocol to a serial device.
+ *
+ * rx is called with blocks of received bytes, as large as the platform could
+ * read in one go.
+ */
+void register_serial(uint8_t device, void (*rx)(uint8_t device, const uint8_t *buf, size_t len), bool debug);
 
 /** Receive byte from device.
  *
@@ -19,4 +36,22 @@ void register_serial(uint8_t device, void (*rx)(uint8_t device, uint8_t ch), boo
  */
 void serial_recv_byte(uint8_t device, uint8_t byte);
 
+/** Receive a block of bytes from device.
+ *
+ * As serial_recv_byte(), but lets the platform pass everything from one read
+ * in a single call.
+ */
+void serial_recv_bytes(uint8_t device, const uint8_t *buf, size_t len);
+
+/** Serve device as KISS over TCP on tcpport.
+ *
+ * Any number of clients may connect.  Everything written to the device is sent
+ * to every client, and frames from each client are received on the device and
+ * relayed to the other clients.
+ *
+ * Returns false if the port couldn't be opened, or isn't supported on this
+ * platform.
+ */
+bool serial_listen_tcp(uint8_t device, uint16_t tcpport);
+
 #endif
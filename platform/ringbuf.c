@@ -0,0 +1,60 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Byte ring buffers, used for buffering output to file descriptors.
+ */
+#include "ringbuf.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
+
+bool ringbuf_push(ringbuf_t *ring, const uint8_t *data, size_t len) {
+    if (len > ringbuf_space(ring))
+        return false;
+
+    size_t tail = (ring->head + ring->len) % ring->size;
+    size_t first = ring->size - tail < len ? ring->size - tail : len;
+    memcpy(&ring->buf[tail], data, first);
+    memcpy(&ring->buf[0], &data[first], len - first);
+    ring->len += len;
+    return true;
+}
+
+/* The queued data is at most two pieces: head to the end of the buffer, then
+ * wrapping around to the start.  Returns how many of iov are used. */
+static int ringbuf_iov(const ringbuf_t *ring, struct iovec iov[2]) {
+    size_t first = ring->size - ring->head < ring->len ? ring->size - ring->head : ring->len;
+    iov[0] = (struct iovec) { .iov_base = &ring->buf[ring->head], .iov_len = first };
+    iov[1] = (struct iovec) { .iov_base = &ring->buf[0], .iov_len = ring->len - first };
+    return iov[1].iov_len ? 2 : 1;
+}
+
+static void ringbuf_consume(ringbuf_t *ring, ssize_t ret) {
+    if (ret > 0) {
+        ring->head = (ring->head + ret) % ring->size;
+        ring->len -= ret;
+        if (ring->len == 0)
+            ring->head = 0;
+    }
+}
+
+ssize_t ringbuf_flush(ringbuf_t *ring, int fd) {
+    if (ring->len == 0)
+        return 0;
+
+    struct iovec iov[2];
+    ssize_t ret = writev(fd, iov, ringbuf_iov(ring, iov));
+    ringbuf_consume(ring, ret);
+    return ret;
+}
+
+ssize_t ringbuf_send(ringbuf_t *ring, int fd) {
+    if (ring->len == 0)
+        return 0;
+
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = ringbuf_iov(ring, iov) };
+    ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    ringbuf_consume(ring, ret);
+    return ret;
+}
@@ -0,0 +1,41 @@
+/* (C) Copyright 2024 Perry Lorier (2E0ITB)
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * Byte ring buffers, used for buffering output to file descriptors.
+ */
+#ifndef RINGBUF_H
+#define RINGBUF_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct ringbuf_t {
+    uint8_t *buf;
+    size_t size;
+    size_t head; /* Offset of the oldest byte */
+    size_t len; /* Number of bytes queued */
+} ringbuf_t;
+
+static inline void ringbuf_init(ringbuf_t *ring, uint8_t *buf, size_t size) {
+    *ring = (ringbuf_t) { .buf = buf, .size = size, .head = 0, .len = 0 };
+}
+
+static inline size_t ringbuf_space(const ringbuf_t *ring) { return ring->size - ring->len; }
+static inline bool ringbuf_empty(const ringbuf_t *ring) { return ring->len == 0; }
+
+/* Queue all of data, or none of it if there isn't enough space. */
+bool ringbuf_push(ringbuf_t *ring, const uint8_t *data, size_t len);
+
+/* Write as much of the ring as possible to fd.
+ *
+ * Returns the result of writev(), so -1 with errno set on error.
+ */
+ssize_t ringbuf_flush(ringbuf_t *ring, int fd);
+
+/* As ringbuf_flush(), but with sendmsg() for sockets, so that a peer that's
+ * gone away gives EPIPE rather than SIGPIPE.
+ */
+ssize_t ringbuf_send(ringbuf_t *ring, int fd);
+
+#endif
@@ -14,3 +14,22 @@ void serial_putch(uint8_t serial, uint8_t data) {
     (void) data;
 }
 
+void serial_write(uint8_t serial, const uint8_t *buf, size_t len) {
+    /* Don't send any data */
+    (void) serial;
+    (void) buf;
+    (void) len;
+}
+
+bool serial_tx_congested(uint8_t serial) {
+    /* Never backs up */
+    (void) serial;
+    return false;
+}
+
+bool serial_listen_tcp(uint8_t device, uint16_t tcpport) {
+    /* No networking */
+    (void) device;
+    (void) tcpport;
+    return false;
+}
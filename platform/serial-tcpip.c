@@ -1,32 +1,252 @@
 /* (C) Copyright 2024 Perry Lorier (2E0ITB)
  * SPDX-License-Identifier: GPL-3.0-or-later
  *
- * A platform that listens on a TCP/IP port.
+ * KISS over TCP/IP.
+ *
+ * A serial device that listens on a TCP port, and accepts multiple clients.
+ * Frames written to the device are sent to every client, frames received from
+ * a client are passed to the device's receiver and relayed to every other
+ * client, so software modems and monitoring tools can share one port.
  */
-#include "platform.h"
-#include "kiss.h"
+#define _POSIX_C_SOURCE 200809L
 #include "serial.h"
+#include "debug.h"
+#include "platform-posix.h"
+#include "ringbuf.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
-#include <stdlib.h>
-#include <unistd.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
-static int serial_fd = -1;
+enum {
+    MAX_TCP_LISTENERS = 4,
+    MAX_TCP_CLIENTS = 16,
+    /* Largest escaped frame we'll reassemble from a client */
+    TCP_FRAME_SIZE = 4200,
+    TCP_OUTPUT_SIZE = 16384,
+    TCP_READ_SIZE = 4096,
+    FEND = 0xC0,
+};
 
-#define NODE "::1"
-#define SERVICE "8001"
+typedef struct tcp_listener_t {
+    fd_event_t event;
+    uint8_t device;
+} tcp_listener_t;
 
-void serial_init(void) {
-    int listenfd = -1;
+typedef struct tcp_client_t {
+    fd_event_t event;
+    tcp_listener_t *listener;
+    /* Bytes received since the last FEND */
+    uint8_t frame[TCP_FRAME_SIZE];
+    size_t frame_len;
+    bool frame_overrun;
+    ringbuf_t output;
+    uint8_t output_buf[TCP_OUTPUT_SIZE];
+} tcp_client_t;
+
+static tcp_listener_t listeners[MAX_TCP_LISTENERS];
+static size_t listener_count = 0;
+static tcp_client_t clients[MAX_TCP_CLIENTS];
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+/* A TCP device is congested when its slowest client is. */
+static void tcp_update_congestion(tcp_listener_t *listener) {
+    size_t queued = 0;
+    for (size_t i = 0; i < MAX_TCP_CLIENTS; ++i) {
+        if (clients[i].listener == listener && clients[i].output.len > queued)
+            queued = clients[i].output.len;
+    }
+    serial_output_queued(listener->device, queued, TCP_OUTPUT_SIZE);
+}
+
+static void tcp_client_close(tcp_client_t *client) {
+    DEBUG(STR("kiss tcp client disconnected"));
+    int fd = client->event.fd;
+    unregister_fd_event(&client->event);
+    close(fd);
+    tcp_listener_t *listener = client->listener;
+    client->listener = NULL;
+    tcp_update_congestion(listener);
+}
+
+/* Write as much queued output as the socket will take.
+ *
+ * Errors are left for the read callback to notice (as a hangup), so that a
+ * client is only ever closed from its own callback.
+ */
+static void tcp_client_flush(fd_event_t *event) {
+    tcp_client_t *client = event->userdata;
+    while (!ringbuf_empty(&client->output)) {
+        ssize_t ret = ringbuf_send(&client->output, event->fd);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && errno != EAGAIN)
+            ringbuf_init(&client->output, client->output_buf, sizeof(client->output_buf));
+        if (ret <= 0)
+            break;
+    }
+    fd_event_set_want_write(event, !ringbuf_empty(&client->output));
+    tcp_update_congestion(client->listener);
+}
+
+/* Queue a frame to a client.  Frames are dropped for clients that are too far
+ * behind, rather than stalling everyone else.
+ */
+static void tcp_client_send(tcp_client_t *client, const uint8_t *buf, size_t len) {
+    if (!ringbuf_push(&client->output, buf, len)) {
+        DEBUG(STR("kiss tcp client too slow, dropping frame"));
+        return;
+    }
+    /* If we're already waiting for the socket to drain, the write callback
+     * will pick this up. */
+    if (!client->event.want_write)
+        tcp_client_flush(&client->event);
+    else
+        tcp_update_congestion(client->listener);
+}
+
+static void tcp_device_write(uint8_t device, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < MAX_TCP_CLIENTS; ++i) {
+        if (clients[i].listener && clients[i].listener->device == device)
+            tcp_client_send(&clients[i], buf, len);
+    }
+}
+
+static void tcp_client_frame(tcp_client_t *client) {
+    uint8_t device = client->listener->device;
+    uint8_t fend = FEND;
+
+    serial_recv_byte(device, FEND);
+    serial_recv_bytes(device, client->frame, client->frame_len);
+    serial_recv_byte(device, FEND);
+
+    for (size_t i = 0; i < MAX_TCP_CLIENTS; ++i) {
+        if (&clients[i] != client && clients[i].listener == client->listener) {
+            if (ringbuf_space(&clients[i].output) < client->frame_len + 2)
+                continue;
+            ringbuf_push(&clients[i].output, &fend, 1);
+            ringbuf_push(&clients[i].output, client->frame, client->frame_len);
+            ringbuf_push(&clients[i].output, &fend, 1);
+            if (!clients[i].event.want_write)
+                tcp_client_flush(&clients[i].event);
+        }
+    }
+}
+
+/* Split the stream from a client into whole frames, so that frames from
+ * different clients are never interleaved.
+ */
+static void tcp_client_recv(tcp_client_t *client, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        const uint8_t *fend = memchr(buf, FEND, len);
+        size_t run = fend ? (size_t)(fend - buf) : len;
+
+        if (client->frame_len + run > sizeof(client->frame)) {
+            client->frame_overrun = true;
+        } else {
+            memcpy(&client->frame[client->frame_len], buf, run);
+            client->frame_len += run;
+        }
+
+        if (!fend)
+            return;
+
+        if (client->frame_len > 0 && !client->frame_overrun)
+            tcp_client_frame(client);
+        client->frame_len = 0;
+        client->frame_overrun = false;
+        buf += run + 1;
+        len -= run + 1;
+    }
+}
+
+static void tcp_client_read(fd_event_t *event) {
+    tcp_client_t *client = event->userdata;
+    uint8_t buf[TCP_READ_SIZE];
+    for (;;) {
+        ssize_t ret = read(event->fd, buf, sizeof(buf));
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && errno == EAGAIN)
+            return;
+        if (ret <= 0) {
+            tcp_client_close(client);
+            return;
+        }
+        tcp_client_recv(client, buf, ret);
+    }
+}
+
+static void tcp_accept(fd_event_t *event) {
+    tcp_listener_t *listener = event->userdata;
+    for (;;) {
+        int fd = accept(event->fd, NULL, NULL);
+        if (fd == -1)
+            return;
+
+        tcp_client_t *client = NULL;
+        for (size_t i = 0; i < MAX_TCP_CLIENTS; ++i) {
+            if (!clients[i].listener) {
+                client = &clients[i];
+                break;
+            }
+        }
+        if (!client || !set_nonblocking(fd)) {
+            DEBUG(STR("kiss tcp: refusing client"));
+            close(fd);
+            continue;
+        }
+
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        client->listener = listener;
+        client->frame_len = 0;
+        client->frame_overrun = false;
+        ringbuf_init(&client->output, client->output_buf, sizeof(client->output_buf));
+        client->event = (fd_event_t) {
+            .next = NULL,
+            .fd = fd,
+            .callback = tcp_client_read,
+            .write_callback = tcp_client_flush,
+            .want_write = false,
+            .userdata = client,
+        };
+        register_fd_event(&client->event);
+        DEBUG(STR("kiss tcp client connected on serial "), D8(listener->device));
+    }
+}
+
+bool serial_listen_tcp(uint8_t device, uint16_t tcpport) {
+    if (listener_count >= MAX_TCP_LISTENERS)
+        return false;
+
+    char service[6];
+    snprintf(service, sizeof(service), "%u", tcpport);
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
     struct addrinfo *addrs = NULL;
-    int r = getaddrinfo(NODE, SERVICE, NULL, &addrs);
-    if (r == -1)
-        panic("cannot lookup address");
+    if (getaddrinfo(NULL, service, &hints, &addrs) != 0)
+        return false;
+
+    int listenfd = -1;
     for (struct addrinfo *rp = addrs; rp != NULL; rp = rp->ai_next) {
-        listenfd = socket(rp->ai_family, rp->ai_socktype,
-                rp->ai_protocol);
+        listenfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
         if (listenfd == -1)
             continue;
 
@@ -37,33 +257,30 @@ void serial_init(void) {
             break;                  /* Success */
 
         close(listenfd);
+        listenfd = -1;
     }
-
-    if (listenfd == -1)
-        panic("cannot bind");
-
     freeaddrinfo(addrs);
 
-    if (listen(listenfd, 1) == -1)
-        panic("cannot listen");
-
-    if ((serial_fd = accept(listenfd, NULL, NULL)) == -1)
-        panic("cannot accept");
-}
+    if (listenfd == -1)
+        return false;
 
-void serial_putch(uint8_t serial, uint8_t data) {
-    if (serial == 0) {
-        if (write(serial_fd, &data, sizeof(data)) == -1)
-            panic("cannot write");
+    if (listen(listenfd, MAX_TCP_CLIENTS) == -1 || !set_nonblocking(listenfd)) {
+        close(listenfd);
+        return false;
     }
-}
 
-int main(int argc, char *argv[]) {
-    serial_init();
-    for (;;) {
-        uint8_t data;
-        if (read(serial_fd, &data, sizeof(data)) != 1)
-            panic("cannot read");
-        kiss_recv_byte(0, data);
-    }
+    tcp_listener_t *listener = &listeners[listener_count++];
+    listener->device = device;
+    listener->event = (fd_event_t) {
+        .next = NULL,
+        .fd = listenfd,
+        .callback = tcp_accept,
+        .write_callback = NULL,
+        .want_write = false,
+        .userdata = listener,
+    };
+    register_fd_event(&listener->event);
+    register_serial_output(device, tcp_device_write);
+    DEBUG(STR("kiss tcp listening on port "), INT(tcpport));
+    return true;
 }
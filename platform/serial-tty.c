@@ -7,23 +7,60 @@
 #include "serial.h"
 #include "platform-posix.h"
 #include "debug.h"
+#include "ringbuf.h"
 //#include "ax25_dl.h"
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <net/if.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <pty.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-enum { MAX_SERIAL = 3 };
+/* Devices backed by a tty, the rest are only usable with their own output
+ * (eg KISS over TCP) */
+enum { MAX_TTYS = 3 };
+/* Most we'll pull from a device in one read() */
+enum { SERIAL_READ_SIZE = 4096 };
 
-void kiss_recv_byte(uint8_t port, uint8_t byte);
+enum { MAX_DEVICES = 16 };
 
-static int serial_fd[MAX_SERIAL] = {-1,-1,-1};
+/* Output queued per tty while it isn't accepting writes */
+enum { SERIAL_OUTPUT_SIZE = 8192 };
+
+static int serial_fd[MAX_TTYS] = {-1,-1,-1};
+static ringbuf_t serial_out[MAX_TTYS];
+static uint8_t serial_out_buf[MAX_TTYS][SERIAL_OUTPUT_SIZE];
+static bool serial_congested[MAX_DEVICES];
+static fd_event_t serial_fd_event[MAX_TTYS];
+
+static void (*serial_output[MAX_DEVICES])(uint8_t device, const uint8_t *buf, size_t len);
+
+void register_serial_output(uint8_t device, void (*write)(uint8_t device, const uint8_t *buf, size_t len)) {
+    CHECK(device < MAX_DEVICES);
+    serial_output[device] = write;
+}
+
+void serial_output_queued(uint8_t device, size_t queued, size_t size) {
+    CHECK(device < MAX_DEVICES);
+    /* Hysteresis, so the protocol layer isn't flapping on and off every frame */
+    if (queued >= size / 4 * 3) {
+        serial_congested[device] = true;
+    } else if (queued <= size / 4 && serial_congested[device]) {
+        serial_congested[device] = false;
+        /* Let anything held up by the congestion go */
+        platform_wakeup();
+    }
+}
+
+bool serial_tx_congested(uint8_t serial) {
+    return serial < MAX_DEVICES && serial_congested[serial];
+}
 
 static void setup_set_raw(int fd) {
     struct termios tbuf;
@@ -77,33 +114,68 @@ static void serial_init_external(int *fd, const char *tty) {
 }
 
 void serial_putch(uint8_t serial, uint8_t data) {
-    CHECK(serial < MAX_SERIAL);
-    if (write(serial_fd[serial], &data, sizeof(data)) == -1)
-        panic("cannot write");
+    serial_write(serial, &data, sizeof(data));
 }
 
-static void serial_got_ch(int serial) {
-    uint8_t data;
-    if (read(serial_fd[serial], &data, sizeof(data)) != 1)
-        panic("cannot read");
-    serial_recv_byte(serial, data);
+static void serial_flush(fd_event_t *event) {
+    uint8_t serial = (uintptr_t) event->userdata;
+    while (!ringbuf_empty(&serial_out[serial])) {
+        ssize_t ret = ringbuf_flush(&serial_out[serial], serial_fd[serial]);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && errno == EAGAIN)
+            break;
+        if (ret <= 0)
+            panic("cannot write");
+    }
+    fd_event_set_want_write(event, !ringbuf_empty(&serial_out[serial]));
+    serial_output_queued(serial, serial_out[serial].len, serial_out[serial].size);
 }
 
-static void serial_got_ch0(void) { serial_got_ch(0); }
-static void serial_got_ch1(void) { serial_got_ch(2); }
-static void serial_got_ch2(void) { serial_got_ch(2); }
+void serial_write(uint8_t serial, const uint8_t *buf, size_t len) {
+    CHECK(serial < MAX_DEVICES);
+    if (serial_output[serial]) {
+        serial_output[serial](serial, buf, len);
+        return;
+    }
+    if (serial >= MAX_TTYS || serial_fd[serial] == -1) {
+        /* Nothing to send it to */
+        return;
+    }
+    /* Writes are queued whole or not at all, so a stalled TNC loses frames
+     * rather than seeing half of one.  We can't DEBUG() about it here, as
+     * debug output comes through here too. */
+    if (!ringbuf_push(&serial_out[serial], buf, len))
+        return;
+    /* If we're already waiting for the fd to drain, the write callback will
+     * pick this up. */
+    if (!serial_fd_event[serial].want_write)
+        serial_flush(&serial_fd_event[serial]);
+    else
+        serial_output_queued(serial, serial_out[serial].len, serial_out[serial].size);
+}
 
-static fd_event_t serial_fd_event[MAX_SERIAL] = {
-    { .next = NULL, .fd = -1, .callback = serial_got_ch0, },
-    { .next = NULL, .fd = -1, .callback = serial_got_ch1, },
-    { .next = NULL, .fd = -1, .callback = serial_got_ch2, },
-};
+static void serial_got_ch(fd_event_t *event) {
+    uint8_t serial = (uintptr_t) event->userdata;
+    uint8_t data[SERIAL_READ_SIZE];
+    /* Drain everything, the event loop may be edge triggered */
+    for (;;) {
+        ssize_t ret = read(serial_fd[serial], data, sizeof(data));
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && errno == EAGAIN)
+            return;
+        if (ret <= 0)
+            panic("cannot read");
+        serial_recv_bytes(serial, data, ret);
+    }
+}
 
 void serial_init(int argc, char *argv[]) {
     /* Open up N serial ports */
-    for (size_t i = 0; i < MAX_SERIAL; ++i) {
+    for (size_t i = 0; i < MAX_TTYS; ++i) {
         if (argc < (ssize_t)i + 2) {
-            if (i == MAX_SERIAL - 1) {
+            if (i == MAX_TTYS - 1) {
                 serial_init_external(&serial_fd[i], "/dev/tty");
             } else {
                 serial_init_pty(&serial_fd[i]);
@@ -113,7 +185,17 @@ void serial_init(int argc, char *argv[]) {
             serial_init_external(&serial_fd[i], argv[i+1]);
             setup_set_raw(serial_fd[i]);
         }
-        serial_fd_event[i].fd = serial_fd[i];
+        ringbuf_init(&serial_out[i], serial_out_buf[i], sizeof(serial_out_buf[i]));
+        if (fcntl(serial_fd[i], F_SETFL, fcntl(serial_fd[i], F_GETFL) | O_NONBLOCK) == -1)
+            panic("failed to set non-blocking");
+        serial_fd_event[i] = (fd_event_t) {
+            .next = NULL,
+            .fd = serial_fd[i],
+            .callback = serial_got_ch,
+            .write_callback = serial_flush,
+            .want_write = false,
+            .userdata = (void *)(uintptr_t) i,
+        };
         register_fd_event(&serial_fd_event[i]);
     }
 }
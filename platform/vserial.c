@@ -9,25 +9,29 @@
 #include "serial.h"
 
 typedef struct vserial_t {
-    void (*rx)(uint8_t port, uint8_t ch);
+    void (*rx)(uint8_t port, const uint8_t *buf, size_t len);
     /// Does this port get debug messages
     bool debug;
 } serial_t;
 
-enum { MAX_DEVICES = 3 };
+enum { MAX_DEVICES = 4 };
 
 static serial_t device2vserial[MAX_DEVICES];
 
-void register_serial(uint8_t device, void (*rx)(uint8_t device, uint8_t ch), bool debug) {
+void register_serial(uint8_t device, void (*rx)(uint8_t device, const uint8_t *buf, size_t len), bool debug) {
     CHECK(device < MAX_DEVICES);
     device2vserial[device].rx = rx;
     device2vserial[device].debug = debug;
 }
 
 void serial_recv_byte(uint8_t device, uint8_t byte) {
+    serial_recv_bytes(device, &byte, sizeof(byte));
+}
+
+void serial_recv_bytes(uint8_t device, const uint8_t *buf, size_t len) {
     CHECK(device < MAX_DEVICES);
-    if (device2vserial[device].rx) {
-        device2vserial[device].rx(device, byte);
+    if (device2vserial[device].rx && len > 0) {
+        device2vserial[device].rx(device, buf, len);
     }
 }
 
@@ -0,0 +1,330 @@
+#!/usr/bin/env python3
+# (C) Copyright 2024 Perry Lorier (2E0ITB)
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Stress test: opens thousands of AX.25 links to app-cli over KISS on TCP.
+#
+# Starts app-cli on a pty, listens with caseflip on NOCALL-3, then plays
+# a TNC on the KISS TCP port.  Every link is from a different remote
+# (R00000-1, R00001-1, ...) and goes through:
+#
+#   SABM -> UA            every link must be accepted
+#   I "ping" -> I "PING"  each one must carry data on its own
+#   DISC -> UA            and they must all tear down again
+#
+# In between, a few links have their reply left unacked, and app-cli must
+# poll for the ack when T1 runs out rather than wait for T3.
+#
+# A second KISS client is connected throughout, and resets its connection
+# just as the I frames start, so app-cli must cope with a client going away
+# while it's writing to it.
+#
+# All the frames for a step are sent at once, so app-cli runs short of
+# buffers and goes busy part way through.  Like a real peer, this acks
+# I frames, answers polls and retries what went unanswered, so every link
+# should still get through once buffers are freed.
+#
+# Build app-cli first (any event loop backend):
+#
+#   cmake -S . -B build && cmake --build build
+#
+# then run:
+#
+#   tools/kiss-stress.py build/apps/app-cli
+#   tools/kiss-stress.py --links 5000 --port 8001 build/apps/app-cli
+#
+# Exits non-zero, listing the first few links that failed, if any link
+# doesn't make it through.  app-cli's output is written to --log.
+
+import argparse
+import os
+import pty
+import select
+import signal
+import socket
+import struct
+import sys
+import threading
+import time
+
+FEND = 0xC0
+FESC = 0xDB
+TFEND = 0xDC
+TFESC = 0xDD
+
+CTL_SABM = 0x3F  # with P set
+CTL_DISC = 0x53  # with P set
+CTL_UA = 0x63
+CTL_RR = 0x01
+CTL_PF = 0x10
+PID_NONE = 0xF0
+
+LOCAL = ("NOCALL", 3)
+RETRY = 3  # seconds
+T1_LINKS = 20
+
+
+def remote(i):
+    return ("R%05d" % i, 1)
+
+
+def addr(call, ssid, last, c_bit):
+    return (bytes(ord(ch) << 1 for ch in call.ljust(6))
+            + bytes([0x60 | (ssid << 1) | (0x80 if c_bit else 0) | (1 if last else 0)]))
+
+
+def command_header(i):
+    call, ssid = remote(i)
+    return addr(*LOCAL, False, True) + addr(call, ssid, True, False)
+
+
+def response_header(i):
+    call, ssid = remote(i)
+    return addr(*LOCAL, False, False) + addr(call, ssid, True, True)
+
+
+def kiss_encode(frame):
+    out = bytearray([FEND, 0x00])
+    for b in frame:
+        if b == FEND:
+            out += bytes([FESC, TFEND])
+        elif b == FESC:
+            out += bytes([FESC, TFESC])
+        else:
+            out.append(b)
+    out.append(FEND)
+    return bytes(out)
+
+
+class KissReader:
+    """Splits a KISS byte stream into AX.25 frames for port 0."""
+
+    def __init__(self):
+        self.frame = bytearray()
+        self.escape = False
+
+    def feed(self, data):
+        frames = []
+        for b in data:
+            if b == FEND:
+                if len(self.frame) > 1 and self.frame[0] == 0x00:
+                    frames.append(bytes(self.frame[1:]))
+                self.frame = bytearray()
+            elif self.escape:
+                self.frame.append(FEND if b == TFEND else FESC if b == TFESC else b)
+                self.escape = False
+            elif b == FESC:
+                self.escape = True
+            else:
+                self.frame.append(b)
+        return frames
+
+
+def link_of(frame):
+    """Returns the link number a frame from app-cli is addressed to, or None."""
+    if len(frame) < 15:
+        return None
+    call = bytes(b >> 1 for b in frame[0:6]).decode("ascii", "replace").strip()
+    if not call.startswith("R") or not call[1:].isdigit():
+        return None
+    return int(call[1:])
+
+
+def start_app(path, port, log):
+    pid, fd = pty.fork()
+    if pid == 0:
+        # Python ignores SIGPIPE, run it as a shell would
+        signal.signal(signal.SIGPIPE, signal.SIG_DFL)
+        os.execv(path, [path])
+
+    def drain():
+        while True:
+            try:
+                data = os.read(fd, 65536)
+            except OSError:
+                return
+            if not data:
+                return
+            log.write(data)
+
+    threading.Thread(target=drain, daemon=True).start()
+    time.sleep(0.3)
+    os.write(fd, b"serial 3 kiss tcp %d\r" % port)
+    os.write(fd, b"register caseflip %s-%d\r" % (LOCAL[0].encode(), LOCAL[1]))
+    return pid
+
+
+def connect(port, timeout):
+    deadline = time.monotonic() + timeout
+    while True:
+        try:
+            return socket.create_connection(("127.0.0.1", port))
+        except OSError:
+            if time.monotonic() > deadline:
+                raise
+            time.sleep(0.1)
+
+
+def reset(sock):
+    """Close with a RST, so app-cli's next write to it fails."""
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+    sock.close()
+
+
+def exited(pid):
+    """Returns why app-cli exited, or None if it's still running."""
+    done, status = os.waitpid(pid, os.WNOHANG)
+    if done == 0:
+        return None
+    if os.WIFSIGNALED(status):
+        return "killed by signal %d" % os.WTERMSIG(status)
+    return "exited with %d" % os.WEXITSTATUS(status)
+
+
+class Peer:
+    """The far end of every link: acks their I frames and answers polls,
+    as app-cli resets links that don't respond."""
+
+    def __init__(self, sock, links):
+        self.sock = sock
+        self.reader = KissReader()
+        self.vr = [0] * links  # V(R), the next I frame expected from them
+        self.vs = [0] * links  # V(S), the next I frame sent to them
+        self.va = [0] * links  # V(A), acked by them
+        self.quiet = False  # Don't ack their I frames unless polled
+        self.unacked = set()
+
+    def i_frame(self, i, info):
+        """A new I frame, or the last one again if it hasn't been acked."""
+        if self.vs[i] == self.va[i]:
+            self.vs[i] = (self.vs[i] + 1) % 8
+        ns = (self.vs[i] - 1) % 8
+        return command_header(i) + bytes([(self.vr[i] << 5) | (ns << 1), PID_NONE]) + info
+
+    def send(self, frame):
+        self.sock.sendall(kiss_encode(frame))
+
+    def rr(self, i, f):
+        self.send(response_header(i) + bytes([(self.vr[i] << 5) | (CTL_PF if f else 0) | CTL_RR]))
+
+    def handle(self, i, frame):
+        ctl = frame[14]
+        poll = bool(ctl & CTL_PF) and bool(frame[6] & 0x80)
+        if ctl & 3 != 3:
+            self.va[i] = ctl >> 5
+        if ctl & 1 == 0:
+            if (ctl >> 1) & 7 == self.vr[i]:
+                self.vr[i] = (self.vr[i] + 1) % 8
+            if self.quiet and not poll:
+                self.unacked.add(i)
+            else:
+                self.unacked.discard(i)
+                self.rr(i, poll)
+        elif ctl & 3 == 1 and poll:
+            self.unacked.discard(i)
+            self.rr(i, True)
+
+    def run_phase(self, name, make_frame, matches, timeout, links=None, retry=True, sent=None):
+        """Sends make_frame(i) for every link (or the first links), and
+        waits for matches(frame) from each.  Links that haven't answered are
+        sent the frame again every RETRY seconds, as app-cli may have gone
+        busy and dropped it.  sent() is called once the first lot are on
+        their way.  Returns the links that never answered."""
+        if links is None:
+            links = len(self.vr)
+        pending = set(range(links))
+        deadline = time.monotonic() + timeout
+        next_retry = 0
+        while pending and time.monotonic() < deadline:
+            if next_retry is not None and time.monotonic() >= next_retry:
+                self.sock.sendall(b"".join(kiss_encode(make_frame(i)) for i in sorted(pending)))
+                next_retry = time.monotonic() + RETRY if retry else None
+                if sent:
+                    sent()
+                    sent = None
+            ready, _, _ = select.select([self.sock], [], [], 0.2)
+            if not ready:
+                continue
+            data = self.sock.recv(1 << 20)
+            if not data:
+                break
+            for frame in self.reader.feed(data):
+                i = link_of(frame)
+                if i is None or i >= len(self.vr):
+                    continue
+                if i in pending and matches(frame):
+                    pending.discard(i)
+                self.handle(i, frame)
+        print("%-5s %d/%d" % (name, links - len(pending), links))
+        return sorted(pending)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stress test app-cli over KISS")
+    parser.add_argument("app", help="path to app-cli")
+    parser.add_argument("--links", type=int, default=5000)
+    parser.add_argument("--port", type=int, default=8001, help="KISS TCP port")
+    parser.add_argument("--timeout", type=float, default=30,
+                        help="seconds to wait for each phase")
+    parser.add_argument("--log", default="kiss-stress.log")
+    args = parser.parse_args()
+
+    with open(args.log, "wb") as log:
+        pid = start_app(args.app, args.port, log)
+        died = None
+        try:
+            peer = Peer(connect(args.port, 5), args.links)
+            bystander = connect(args.port, 5)
+            phases = [
+                ("SABM",
+                 lambda i: command_header(i) + bytes([CTL_SABM]),
+                 lambda f: f[14] & ~CTL_PF == CTL_UA),
+                # caseflip drops data it can't reply to, so retries are
+                # new I frames once it's acked the last one
+                ("I",
+                 lambda i: peer.i_frame(i, b"ping"),
+                 lambda f: f[14] & 1 == 0 and f[16:] == b"PING"),
+                # Their reply goes unacked, so T1 must be running and end in
+                # a poll.  Only a few links, so none of them go busy.
+                ("T1",
+                 lambda i: peer.i_frame(i, b"ping"),
+                 lambda f: f[14] & 3 == 1 and f[14] & CTL_PF and f[6] & 0x80
+                           and link_of(f) in peer.unacked),
+                ("DISC",
+                 lambda i: command_header(i) + bytes([CTL_DISC]),
+                 lambda f: f[14] & ~CTL_PF == CTL_UA),
+            ]
+            for name, make_frame, matches in phases:
+                peer.quiet = name == "T1"
+                try:
+                    if peer.quiet:
+                        failed = peer.run_phase(name, make_frame, matches, args.timeout,
+                                                links=min(args.links, T1_LINKS), retry=False)
+                    elif name == "I":
+                        # Gone while app-cli is busy replying to everyone
+                        failed = peer.run_phase(name, make_frame, matches, args.timeout,
+                                                sent=lambda: reset(bystander))
+                    else:
+                        failed = peer.run_phase(name, make_frame, matches, args.timeout)
+                except OSError as e:
+                    failed = None
+                    print("%s: %s" % (name, e))
+                died = exited(pid)
+                if died:
+                    print("app-cli %s" % died)
+                    return 1
+                if failed is None:
+                    return 1
+                if failed:
+                    print("%s failed for %d links, eg %s" % (
+                        name, len(failed), ", ".join("R%05d" % i for i in failed[:10])))
+                    return 1
+            print("ok")
+            return 0
+        finally:
+            if not died:
+                os.kill(pid, signal.SIGTERM)
+                os.waitpid(pid, 0)
+
+if __name__ == "__main__":
+    sys.exit(main())